@@ -4,11 +4,16 @@
 #include <sys/time.h>
 #include <sys/types.h>
 #include <sys/stat.h>
+#include <sys/ioctl.h>
+#include <sys/mman.h>
+#include <sys/socket.h>
+#include <linux/if_alg.h>
 #include <fcntl.h>
 #include <unistd.h>
 #include <errno.h>
+#include "caesar.h"
 
-#define DEVFILE "/dev/caesar"
+#define DEVFILE "/dev/caesar0"
 #define STRING1 "czggj, rjmgy!" /* "hello world!" */
 #define STRING2 "Yjk'o wz gvut!" /* "Don't be Lazy!" */
 #define STRING3 "D'h izgdj" /* "I'm nelio" */
@@ -33,47 +38,125 @@ void close_file(int fd)
 	}
 }
 
-void read_file(int fd, int len)
+void set_key(int fd, int key, int decrypt)
 {
-	unsigned char buf[256] = {'\0'};
+	struct caesar_key k = { .key = key, .decrypt = decrypt };
 
-	ssize_t ret;
+	if (ioctl(fd, CAESAR_SET_KEY, &k) < 0) {
+		perror("CAESAR_SET_KEY");
+	}
+}
+
+/* one syscall per message: the buffer comes back transformed */
+void transform(int fd, char *buf)
+{
+	struct caesar_buf b = { .addr = (unsigned long)buf, .len = strlen(buf) };
 
-	ret = read(fd, buf, len);
-	if (ret > 0) {
-		printf("%s\n", buf);
+	if (ioctl(fd, CAESAR_TRANSFORM, &b) < 0) {
+		perror("CAESAR_TRANSFORM");
+		return;
+	}
+	printf("%s\n", buf);
+}
+
+/* zero-copy: fill the mapped buffer, transform it where it is */
+void transform_mapped(int fd, char *str)
+{
+	struct caesar_range r = { .offset = 0, .len = strlen(str) };
+	size_t size = 4096;
+	char *map;
+
+	map = mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+	if (map == MAP_FAILED) {
+		perror("mmap");
+		return;
+	}
+	memcpy(map, str, r.len);
+	if (ioctl(fd, CAESAR_TRANSFORM_MAP, &r) < 0) {
+		perror("CAESAR_TRANSFORM_MAP");
 	} else {
-		perror("read");
+		printf("%.*s\n", (int)r.len, map);
 	}
+	munmap(map, size);
 }
 
-void write_file(int fd, char *buf)
+/* the same cipher through the crypto API: AF_ALG, skcipher "caesar" */
+void transform_alg(char *str, unsigned char key)
 {
-	ssize_t ret;
+	struct sockaddr_alg sa = {
+		.salg_family = AF_ALG,
+		.salg_type = "skcipher",
+		.salg_name = "caesar",
+	};
+	char cbuf[CMSG_SPACE(sizeof(__u32))] = {0};
+	struct iovec iov = { .iov_base = str, .iov_len = strlen(str) };
+	struct msghdr msg = {
+		.msg_iov = &iov,
+		.msg_iovlen = 1,
+		.msg_control = cbuf,
+		.msg_controllen = sizeof(cbuf),
+	};
+	struct cmsghdr *cmsg;
+	int tfm, op;
+
+	tfm = socket(AF_ALG, SOCK_SEQPACKET, 0);
+	if (tfm < 0) {
+		perror("socket");
+		return;
+	}
+	if (bind(tfm, (struct sockaddr *)&sa, sizeof(sa)) < 0 ||
+			setsockopt(tfm, SOL_ALG, ALG_SET_KEY, &key, 1) < 0) {
+		perror("AF_ALG");
+		close(tfm);
+		return;
+	}
+	op = accept(tfm, NULL, 0);
+	if (op < 0) {
+		perror("accept");
+		close(tfm);
+		return;
+	}
 
-	ret = write(fd, buf, strlen(buf));
-	if (ret <= 0) {
-		perror("write");
+	cmsg = CMSG_FIRSTHDR(&msg);
+	cmsg->cmsg_level = SOL_ALG;
+	cmsg->cmsg_type = ALG_SET_OP;
+	cmsg->cmsg_len = CMSG_LEN(sizeof(__u32));
+	*(__u32 *)CMSG_DATA(cmsg) = ALG_OP_ENCRYPT;
+
+	if (sendmsg(op, &msg, 0) < 0 || read(op, str, iov.iov_len) < 0) {
+		perror("AF_ALG");
+	} else {
+		printf("%s\n", str);
 	}
+	close(op);
+	close(tfm);
 }
 
 int main(void)
 {
 	int fd;
-	char *str1 = STRING1;
-	char *str2 = STRING2;
-	char *str3 = STRING3;
+	char str1[] = STRING1;
+	char str2[] = STRING2;
+	char str3[] = STRING3;
 
 	fd = open_file(DEVFILE);
 
-	write_file(fd, str1);
-	read_file(fd, strlen(str1));
+	set_key(fd, 5, 0);
+	transform(fd, str1);
+	transform(fd, str2);
+	transform(fd, str3);
+
+	/* and back again */
+	set_key(fd, 5, 1);
+	transform(fd, str1);
+	transform(fd, str2);
+	transform(fd, str3);
 
-	write_file(fd, str2);
-	read_file(fd, strlen(str2));
+	set_key(fd, 5, 0);
+	transform_mapped(fd, STRING1);
 
-	write_file(fd, str3);
-	read_file(fd, strlen(str3));
+	strcpy(str1, STRING1);
+	transform_alg(str1, 5);
 
 	close_file(fd);
 
@@ -4,89 +4,1156 @@
 #include <linux/types.h>
 #include <linux/kernel.h>
 #include <linux/fs.h>
+#include <linux/mm.h>
+#include <linux/mutex.h>
+#include <linux/spinlock.h>
+#include <linux/vmalloc.h>
+#include <linux/workqueue.h>
+#include <linux/completion.h>
+#include <linux/atomic.h>
+#include <linux/uio.h>
+#include <linux/poll.h>
+#include <linux/wait.h>
+#include <linux/pipe_fs_i.h>
+#include <linux/splice.h>
+#include <crypto/internal/skcipher.h>
 #include <linux/device.h>
 #include <linux/cdev.h>
 #include <linux/sched.h>
+#include <linux/uaccess.h>
 #include <asm/current.h>
 #include <asm/uaccess.h>
+#include <asm/unaligned.h>
+#ifdef CONFIG_X86_64
+#include <asm/cpufeature.h>
+#include <asm/fpu/api.h>
+#include <asm/simd.h>
+#endif
+#include "caesar.h"
 
 MODULE_LICENSE("Dual BSD/GPL");
 
 #define DRIVER_NAME "caesar"
 #define KEY (5)
-#define MAX_DATA_SIZE 4096
+#define CAESAR_RING_SLOTS 16 /* initial page slots, a power of two */
+#define CAESAR_SIMD_MIN 256 /* smaller buffers aren't worth the FPU state */
+#define CAESAR_CHUNK (64 << 10) /* transformed between two cond_resched() */
 
-static int caesar_devs = 1; /* device count */
+static unsigned int caesar_devs = 1; /* device count: /dev/caesar0 .. */
+module_param(caesar_devs, uint, 0444);
 static int caesar_major = 0; /* dynamic allocation */
 module_param(caesar_major, uint, 0); /* args when running insmod caesar_major=<args> */
-static struct cdev caesar_cdev;
+/* most bytes a device buffers before writes come up short */
+static unsigned long caesar_max_buffer = 16 << 20;
+module_param(caesar_max_buffer, ulong, 0644);
+/* transforms this large are spread over the CPUs, 0: never */
+static unsigned long caesar_parallel_min = 1 << 20;
+module_param(caesar_parallel_min, ulong, 0644);
+/* free ring pages kept for the next writer instead of going back to the page allocator */
+static unsigned int caesar_pool_max = 256;
+module_param(caesar_pool_max, uint, 0644);
+static struct workqueue_struct *caesar_wq;
+static struct kmem_cache *caesar_cachep; /* struct caesar_data */
+static LIST_HEAD(caesar_pool);
+static DEFINE_SPINLOCK(caesar_pool_lock);
+static unsigned int caesar_pool_count;
 static struct class *caesar_class = NULL;
-static struct device *caesar_dev;
 
+/*
+ * The stream buffer: a FIFO of pages addressed by absolute stream
+ * offsets. Byte n lives in slot (n >> PAGE_SHIFT) & (nr_slots - 1), so
+ * the pages between head and tail are always there; the writer adds a
+ * page when it starts one, the reader frees it when it is done with it,
+ * and the slot array doubles when the writer runs out of slots. A
+ * device nobody has written to has no slot array and no pages at all.
+ *
+ * Readers own the head and writers the tail, each side under its own
+ * mutex of struct caesar_device; the device spinlock covers the moment
+ * either of them moves its cursor or touches the slot array.
+ */
+struct caesar_ring {
+	struct page **slots;
+	unsigned int nr_slots;
+	u64 head; /* next byte to read */
+	u64 tail; /* next byte to write */
+};
+
+/*
+ * One minor: the stream all of its handles write to and read from.
+ * One reader and one writer can be at work at the same time, and
+ * neither holds anything the other needs while it copies user data.
+ */
+struct caesar_device {
+	struct cdev cdev;
+	struct caesar_ring ring;
+	spinlock_t lock; /* ring cursors and slots */
+	struct mutex read_lock; /* one reader at a time, owns the head */
+	struct mutex write_lock; /* one writer at a time, owns the tail */
+	wait_queue_head_t readq; /* waiting for data */
+	wait_queue_head_t writeq; /* waiting for room */
+};
+
+static struct caesar_device *caesar_devices;
+
+/* a key ready for use: its shift and its byte translation table */
+struct caesar_cipher {
+	int shift; /* 0..25 */
+	u8 table[256];
+};
+
+/* one open file: its key and its mmap() buffer, the stream is the device's */
 struct caesar_data {
-	rwlock_t lock;
-	char data[MAX_DATA_SIZE];
-	int key;
+	struct caesar_device *dev;
+	struct mutex lock; /* the key */
+	int key; /* as set with CAESAR_SET_KEY */
+	bool decrypt;
+	struct caesar_cipher cipher;
+	/* mmap() buffer; mmap_lock nests outside, never held across user copies */
+	struct mutex map_lock;
+	void *map;
+	size_t map_size;
 };
 
-ssize_t caesar_write(struct file *filp, const char __user *buf, size_t count,
-		loff_t *f_ops)
+/*
+ * Shift the letters of @data by @key places, leave everything else
+ * alone. The reference version, byte by byte; @key is 0..25.
+ */
+static void caesar_transform_scalar(char *data, size_t len, int key)
+{
+	size_t i;
+
+	for (i = 0; i < len; i++) {
+		if ('A' <= data[i] && data[i] <= 'Z') {
+			data[i] = 'A' + (data[i] + key - 'A') % 26;
+		} else if ('a' <= data[i] && data[i] <= 'z') {
+			data[i] = 'a' + (data[i] + key - 'a') % 26;
+		}
+	}
+}
+
+/* What @key shifts by, 0..25, one way or the other. */
+static int caesar_shift(int key, bool decrypt)
+{
+	int shift = ((key % 26) + 26) % 26;
+
+	return decrypt ? (26 - shift) % 26 : shift;
+}
+
+/*
+ * Work out the table of a shift once, from the reference, so that the
+ * byte-at-a-time path is a single lookup per byte.
+ */
+static void caesar_cipher_init(struct caesar_cipher *c, int shift)
 {
-	struct caesar_data *p = filp->private_data;
-	int retval = 0;
 	int i;
 
-	printk(KERN_ALERT "%s: count %ld pos %lld\n", __func__, count, *f_ops);
+	c->shift = shift;
+	for (i = 0; i < 256; i++)
+		c->table[i] = i;
+	caesar_transform_scalar((char *)c->table, 256, shift);
+}
 
-	if (count > 0) {
-		write_lock(&p->lock);
+static void caesar_transform_table(const struct caesar_cipher *c, char *data,
+		size_t len)
+{
+	size_t i;
 
-		if (!p) {
-			retval = -ENOMEM;
-			printk(KERN_ALERT "%s:%d failed to kmalloc\n", __func__, __LINE__);
-			goto exit;
+	for (i = 0; i < len; i++)
+		data[i] = c->table[(u8)data[i]];
+}
+
+#define CAESAR_BYTES(b) ((u64)(b) * 0x0101010101010101ULL)
+
+/*
+ * The same on eight bytes at once, without branches. Every step stays
+ * within its byte: folding to lower case (| 0x20) puts both cases at
+ * the same offset from 'a', a letter is an ASCII byte with an offset
+ * below 26, and it wraps when offset + key reaches 26. Letters get
+ * key added, wrapped ones 26 taken off again; neither carries.
+ */
+static u64 caesar_swar(u64 w, int key)
+{
+	u64 t = (w & CAESAR_BYTES(0x7f)) | CAESAR_BYTES(0x20);
+	u64 off = ((t | CAESAR_BYTES(0x80)) - CAESAR_BYTES('a')) & CAESAR_BYTES(0x7f);
+	u64 letter = ~(off + CAESAR_BYTES(0x80 - 26)) & ~w & CAESAR_BYTES(0x80);
+	u64 wrap = (off + CAESAR_BYTES(0x80 - 26 + key)) & letter;
+
+	return w + (letter >> 7) * key - (wrap >> 7) * 26;
+}
+
+static size_t caesar_transform_swar(char *data, size_t len, int key)
+{
+	size_t i, n = len & ~(size_t)7;
+
+	for (i = 0; i < n; i += 8)
+		put_unaligned(caesar_swar(get_unaligned((u64 *)(data + i)), key),
+				(u64 *)(data + i));
+	return n;
+}
+
+/* which vector unit caesar_transform() uses, set at load */
+enum { CAESAR_SIMD_NONE, CAESAR_SIMD_SSE2, CAESAR_SIMD_AVX2 };
+static int caesar_simd = CAESAR_SIMD_NONE;
+
+#ifdef CONFIG_X86_64
+/*
+ * SSE2 and AVX2: the same steps on 16 or 32 bytes, with unsigned
+ * min/compare standing in for the range checks and the key picked
+ * per byte as key or key - 26. Runs between kernel_fpu_begin() and
+ * kernel_fpu_end(), the constants are rows of struct caesar_simd.
+ */
+struct caesar_simd {
+	u8 fold[32]; /* 0x20 */
+	u8 a[32]; /* 'a' */
+	u8 last[32]; /* 25: highest offset of a letter */
+	u8 nowrap[32]; /* 25 - key: highest offset that doesn't wrap */
+	u8 key[32];
+	u8 wrapkey[32]; /* key - 26 */
+};
+
+static void caesar_simd_init(struct caesar_simd *c, int key)
+{
+	memset(c->fold, 0x20, 32);
+	memset(c->a, 'a', 32);
+	memset(c->last, 25, 32);
+	memset(c->nowrap, 25 - key, 32);
+	memset(c->key, key, 32);
+	memset(c->wrapkey, key - 26, 32);
+}
+
+static void caesar_sse2(char *p, size_t blocks, const struct caesar_simd *c)
+{
+	asm volatile(
+		"movdqu   0(%[c]), %%xmm2\n\t"
+		"movdqu  32(%[c]), %%xmm3\n\t"
+		"movdqu  64(%[c]), %%xmm4\n\t"
+		"movdqu  96(%[c]), %%xmm5\n\t"
+		"movdqu 128(%[c]), %%xmm8\n\t"
+		"movdqu 160(%[c]), %%xmm9\n\t"
+		"1:\n\t"
+		"movdqu (%[p]), %%xmm0\n\t"
+		"movdqa %%xmm0, %%xmm1\n\t"
+		"por %%xmm2, %%xmm1\n\t"		/* folded */
+		"psubb %%xmm3, %%xmm1\n\t"		/* offset from 'a' */
+		"movdqa %%xmm1, %%xmm6\n\t"
+		"pminub %%xmm4, %%xmm6\n\t"
+		"pcmpeqb %%xmm1, %%xmm6\n\t"		/* letters */
+		"movdqa %%xmm1, %%xmm7\n\t"
+		"pminub %%xmm5, %%xmm7\n\t"
+		"pcmpeqb %%xmm1, %%xmm7\n\t"		/* no wrap */
+		"movdqa %%xmm8, %%xmm1\n\t"
+		"pand %%xmm7, %%xmm1\n\t"
+		"pandn %%xmm9, %%xmm7\n\t"
+		"por %%xmm7, %%xmm1\n\t"		/* key or key - 26 */
+		"pand %%xmm6, %%xmm1\n\t"
+		"paddb %%xmm1, %%xmm0\n\t"
+		"movdqu %%xmm0, (%[p])\n\t"
+		"add $16, %[p]\n\t"
+		"dec %[n]\n\t"
+		"jnz 1b\n\t"
+		: [p] "+r" (p), [n] "+r" (blocks)
+		: [c] "r" (c)
+		: "memory", "cc", "xmm0", "xmm1", "xmm2", "xmm3", "xmm4",
+		  "xmm5", "xmm6", "xmm7", "xmm8", "xmm9");
+}
+
+static void caesar_avx2(char *p, size_t blocks, const struct caesar_simd *c)
+{
+	asm volatile(
+		"vmovdqu   0(%[c]), %%ymm2\n\t"
+		"vmovdqu  32(%[c]), %%ymm3\n\t"
+		"vmovdqu  64(%[c]), %%ymm4\n\t"
+		"vmovdqu  96(%[c]), %%ymm5\n\t"
+		"vmovdqu 128(%[c]), %%ymm8\n\t"
+		"vmovdqu 160(%[c]), %%ymm9\n\t"
+		"1:\n\t"
+		"vmovdqu (%[p]), %%ymm0\n\t"
+		"vpor %%ymm2, %%ymm0, %%ymm1\n\t"
+		"vpsubb %%ymm3, %%ymm1, %%ymm1\n\t"
+		"vpminub %%ymm4, %%ymm1, %%ymm6\n\t"
+		"vpcmpeqb %%ymm1, %%ymm6, %%ymm6\n\t"
+		"vpminub %%ymm5, %%ymm1, %%ymm7\n\t"
+		"vpcmpeqb %%ymm1, %%ymm7, %%ymm7\n\t"
+		"vpblendvb %%ymm7, %%ymm8, %%ymm9, %%ymm1\n\t"
+		"vpand %%ymm6, %%ymm1, %%ymm1\n\t"
+		"vpaddb %%ymm1, %%ymm0, %%ymm0\n\t"
+		"vmovdqu %%ymm0, (%[p])\n\t"
+		"add $32, %[p]\n\t"
+		"dec %[n]\n\t"
+		"jnz 1b\n\t"
+		"vzeroupper\n\t"
+		: [p] "+r" (p), [n] "+r" (blocks)
+		: [c] "r" (c)
+		: "memory", "cc", "xmm0", "xmm1", "xmm2", "xmm3", "xmm4",
+		  "xmm5", "xmm6", "xmm7", "xmm8", "xmm9");
+}
+
+static size_t caesar_transform_simd(char *data, size_t len, int key)
+{
+	struct caesar_simd c;
+	size_t width, n;
+
+	if (caesar_simd == CAESAR_SIMD_NONE || len < CAESAR_SIMD_MIN || !may_use_simd())
+		return 0;
+	width = caesar_simd == CAESAR_SIMD_AVX2 ? 32 : 16;
+	n = len & ~(width - 1);
+	caesar_simd_init(&c, key);
+	kernel_fpu_begin();
+	if (caesar_simd == CAESAR_SIMD_AVX2)
+		caesar_avx2(data, n / width, &c);
+	else
+		caesar_sse2(data, n / width, &c);
+	kernel_fpu_end();
+	return n;
+}
+#else
+static size_t caesar_transform_simd(char *data, size_t len, int key)
+{
+	return 0;
+}
+#endif
+
+/*
+ * The fast path: vectors for the bulk, words for what's left, table
+ * lookups for the last few bytes. Gives the same bytes as
+ * caesar_transform_scalar() with the cipher's shift.
+ */
+static void caesar_transform(const struct caesar_cipher *c, char *data, size_t len)
+{
+	size_t done;
+
+	done = caesar_transform_simd(data, len, c->shift);
+	done += caesar_transform_swar(data + done, len - done, c->shift);
+	caesar_transform_table(c, data + done, len - done);
+}
+
+/*
+ * Check the fast path against the reference for every key, on every
+ * byte value, at every alignment, for short buffers (words and bytes
+ * only) and long ones (vectors, then words and bytes). Run at load for
+ * each vector unit the CPU has, before anyone can open the device.
+ */
+#define CAESAR_TEST_LEN 1024
+
+static int caesar_selftest_one(char *ref, char *buf,
+		const struct caesar_cipher *c, int len)
+{
+	int key = c->shift, off = len & 31, i;
+
+	for (i = 0; i < len; i++)
+		ref[off + i] = buf[off + i] = (char)(i * 7 + key + len);
+	caesar_transform_scalar(ref + off, len, key);
+	caesar_transform(c, buf + off, len);
+	if (memcmp(ref + off, buf + off, len)) {
+		printk(KERN_ERR "%s: self-test failed, simd %d key %d len %d\n",
+				DRIVER_NAME, caesar_simd, key, len);
+		return -EINVAL;
+	}
+	return 0;
+}
+
+static int caesar_selftest(void)
+{
+	struct caesar_cipher c;
+	char *ref, *buf;
+	int key, len, err = 0;
+
+	ref = kmalloc(2 * (CAESAR_TEST_LEN + 32), GFP_KERNEL);
+	if (ref == NULL)
+		return -ENOMEM;
+	buf = ref + CAESAR_TEST_LEN + 32;
+
+	for (key = 0; key < 26 && !err; key++) {
+		caesar_cipher_init(&c, key);
+		for (len = 0; len < 72 && !err; len++)
+			err = caesar_selftest_one(ref, buf, &c, len);
+		for (len = CAESAR_TEST_LEN - 72; len <= CAESAR_TEST_LEN && !err; len++)
+			err = caesar_selftest_one(ref, buf, &c, len);
+	}
+	kfree(ref);
+	return err;
+}
+
+/* Pick the widest vector unit, after testing it and every narrower one. */
+static int caesar_setup_transform(void)
+{
+	int best = CAESAR_SIMD_NONE, err;
+
+#ifdef CONFIG_X86_64
+	best = CAESAR_SIMD_SSE2;
+	if (boot_cpu_has(X86_FEATURE_AVX2) &&
+			cpu_has_xfeatures(XFEATURE_MASK_SSE | XFEATURE_MASK_YMM, NULL))
+		best = CAESAR_SIMD_AVX2;
+	for (caesar_simd = CAESAR_SIMD_NONE; caesar_simd < best; caesar_simd++) {
+		err = caesar_selftest();
+		if (err)
+			return err;
+	}
+	caesar_simd = best;
+#endif
+	err = caesar_selftest();
+	if (err)
+		return err;
+	printk(KERN_INFO "%s: transform self-test passed (simd %d)\n", DRIVER_NAME, best);
+	return 0;
+}
+
+/*
+ * Ring pages come from a small pool shared by all handles, so opening,
+ * writing and closing over and over doesn't keep the page allocator
+ * busy. Only pages nobody else holds go back to it: one still sitting
+ * in a pipe after splice() is simply let go.
+ */
+static struct page *caesar_page_get(void)
+{
+	struct page *page = NULL;
+
+	spin_lock(&caesar_pool_lock);
+	if (caesar_pool_count) {
+		page = list_first_entry(&caesar_pool, struct page, lru);
+		list_del(&page->lru);
+		caesar_pool_count--;
+	}
+	spin_unlock(&caesar_pool_lock);
+	if (page == NULL)
+		page = alloc_page(GFP_KERNEL);
+	return page;
+}
+
+static void caesar_page_put(struct page *page)
+{
+	if (page_ref_count(page) == 1) {
+		spin_lock(&caesar_pool_lock);
+		if (caesar_pool_count < READ_ONCE(caesar_pool_max)) {
+			list_add(&page->lru, &caesar_pool);
+			caesar_pool_count++;
+			page = NULL;
+		}
+		spin_unlock(&caesar_pool_lock);
+	}
+	if (page)
+		put_page(page);
+}
+
+static void caesar_pool_drain(void)
+{
+	struct page *page, *next;
+
+	list_for_each_entry_safe(page, next, &caesar_pool, lru) {
+		list_del(&page->lru);
+		__free_page(page);
+	}
+	caesar_pool_count = 0;
+}
+
+/* Empty; the slots and pages come with the first write. */
+static void caesar_ring_init(struct caesar_ring *r)
+{
+	r->slots = NULL;
+	r->nr_slots = 0;
+	r->head = 0;
+	r->tail = 0;
+}
+
+static struct page **caesar_ring_slot(struct caesar_ring *r, u64 pos)
+{
+	return &r->slots[(pos >> PAGE_SHIFT) & (r->nr_slots - 1)];
+}
+
+static void caesar_ring_free(struct caesar_ring *r)
+{
+	u64 i;
+
+	for (i = r->head >> PAGE_SHIFT; i < DIV_ROUND_UP_ULL(r->tail, PAGE_SIZE); i++)
+		caesar_page_put(r->slots[i & (r->nr_slots - 1)]);
+	kvfree(r->slots);
+	r->slots = NULL;
+}
+
+/* Also used without the lock, by poll and the wait conditions. */
+static size_t caesar_ring_len(struct caesar_ring *r)
+{
+	return READ_ONCE(r->tail) - READ_ONCE(r->head);
+}
+
+/*
+ * Put a page in the ring for the next writer byte, at @pos (on a page
+ * boundary, at or past the tail), doubling the slot array first when
+ * it is full. The caller holds the write lock, so nobody else changes
+ * the slot array; readers only move the head on, which never makes
+ * the room we saw smaller.
+ */
+static int caesar_ring_add_page(struct caesar_device *d, u64 pos)
+{
+	struct caesar_ring *r = &d->ring;
+	struct page **slots = NULL;
+	struct page *page;
+	unsigned int n = r->nr_slots;
+	u64 i;
+
+	page = caesar_page_get();
+	if (page == NULL)
+		return -ENOMEM;
+	if ((pos >> PAGE_SHIFT) - (READ_ONCE(r->head) >> PAGE_SHIFT) >= n) {
+		n = n ? n * 2 : CAESAR_RING_SLOTS;
+		slots = kvcalloc(n, sizeof(*slots), GFP_KERNEL);
+		if (slots == NULL) {
+			caesar_page_put(page);
+			return -ENOMEM;
+		}
+	}
+
+	spin_lock(&d->lock);
+	if (slots) {
+		/* same pages at their new place */
+		for (i = r->head >> PAGE_SHIFT; i < pos >> PAGE_SHIFT; i++)
+			slots[i & (n - 1)] = r->slots[i & (r->nr_slots - 1)];
+		swap(r->slots, slots);
+		r->nr_slots = n;
+	}
+	*caesar_ring_slot(r, pos) = page;
+	spin_unlock(&d->lock);
+
+	kvfree(slots);
+	return 0;
+}
+
+/* The page holding byte @pos, for a reader. */
+static struct page *caesar_ring_page(struct caesar_device *d, u64 pos)
+{
+	struct page *page;
+
+	spin_lock(&d->lock);
+	page = *caesar_ring_slot(&d->ring, pos);
+	spin_unlock(&d->lock);
+	return page;
+}
+
+/*
+ * A reader is done with @n bytes at the head. Returns the page they
+ * finished, if they did, for the caller to let go of.
+ */
+static struct page *caesar_ring_consume(struct caesar_device *d, size_t n)
+{
+	struct caesar_ring *r = &d->ring;
+	struct page **slot, *page = NULL;
+
+	spin_lock(&d->lock);
+	slot = caesar_ring_slot(r, r->head);
+	WRITE_ONCE(r->head, r->head + n);
+	if (n && offset_in_page(r->head) == 0) {
+		page = *slot;
+		*slot = NULL;
+	}
+	spin_unlock(&d->lock);
+	return page;
+}
+
+/* Bytes a reader may take now. */
+static size_t caesar_ring_avail(struct caesar_device *d)
+{
+	size_t len;
+
+	spin_lock(&d->lock);
+	len = d->ring.tail - d->ring.head;
+	spin_unlock(&d->lock);
+	return len;
+}
+
+/*
+ * A large transform, cut into CAESAR_CHUNK pieces that the caller and
+ * up to one helper per other online CPU take in turn. The helpers are
+ * work items on an unbound (so NUMA-aware) workqueue; the caller waits
+ * for the last of them. The data is either a linear buffer or bytes
+ * [start, end) of a ring whose pages don't move meanwhile.
+ */
+struct caesar_job {
+	const struct caesar_cipher *cipher;
+	char *buf;
+	struct caesar_ring *ring;
+	u64 start, end;
+	unsigned int nr_chunks;
+	atomic_t next; /* next chunk to take */
+	atomic_t running; /* the caller and the helpers still at it */
+	struct completion done;
+};
+
+struct caesar_helper {
+	struct work_struct work;
+	struct caesar_job *job;
+};
+
+static void caesar_job_chunk(struct caesar_job *job, unsigned int i)
+{
+	u64 pos = job->start + (u64)i * CAESAR_CHUNK;
+	u64 end = min_t(u64, pos + CAESAR_CHUNK, job->end);
+	size_t len, off;
+
+	if (job->ring == NULL) {
+		caesar_transform(job->cipher, job->buf + pos, end - pos);
+		return;
+	}
+	for (; pos < end; pos += len) {
+		off = offset_in_page(pos);
+		len = min_t(u64, PAGE_SIZE - off, end - pos);
+		caesar_transform(job->cipher,
+				page_address(*caesar_ring_slot(job->ring, pos)) + off, len);
+	}
+}
+
+static void caesar_job_work(struct caesar_job *job)
+{
+	unsigned int i;
+
+	while ((i = atomic_inc_return(&job->next) - 1) < job->nr_chunks) {
+		caesar_job_chunk(job, i);
+		cond_resched();
+	}
+	if (atomic_dec_and_test(&job->running))
+		complete(&job->done);
+}
+
+static void caesar_helper_fn(struct work_struct *work)
+{
+	caesar_job_work(container_of(work, struct caesar_helper, work)->job);
+}
+
+static void caesar_job_run(struct caesar_job *job)
+{
+	struct caesar_helper *h = NULL;
+	int i, n;
+
+	job->nr_chunks = DIV_ROUND_UP_ULL(job->end - job->start, CAESAR_CHUNK);
+	n = min_t(int, num_online_cpus(), job->nr_chunks) - 1;
+	if (n > 0)
+		h = kcalloc(n, sizeof(*h), GFP_KERNEL);
+	if (h == NULL)
+		n = 0; /* all on our own then */
+
+	atomic_set(&job->next, 0);
+	atomic_set(&job->running, n + 1);
+	init_completion(&job->done);
+	for (i = 0; i < n; i++) {
+		h[i].job = job;
+		INIT_WORK(&h[i].work, caesar_helper_fn);
+		queue_work(caesar_wq, &h[i].work);
+	}
+	caesar_job_work(job);
+	wait_for_completion(&job->done);
+	kfree(h);
+}
+
+/* Transform bytes [start, end) of @r, in parallel if there are enough. */
+static void caesar_transform_ring(const struct caesar_cipher *c,
+		struct caesar_ring *r, u64 start, u64 end)
+{
+	struct caesar_job job = {
+		.cipher = c,
+		.ring = r,
+		.start = start,
+		.end = end,
+	};
+	unsigned int i, n;
+
+	if (caesar_parallel_min && end - start >= caesar_parallel_min) {
+		caesar_job_run(&job);
+		return;
+	}
+	n = DIV_ROUND_UP_ULL(end - start, CAESAR_CHUNK);
+	for (i = 0; i < n; i++) {
+		caesar_job_chunk(&job, i);
+		cond_resched();
+	}
+}
+
+/*
+ * The handle's key as it is now, so nothing holds its lock for long.
+ * With @nowait, -EAGAIN rather than wait behind a CAESAR_SET_KEY.
+ */
+static int caesar_get_cipher(struct caesar_data *p, struct caesar_cipher *c,
+		bool nowait)
+{
+	if (nowait) {
+		if (!mutex_trylock(&p->lock))
+			return -EAGAIN;
+	} else if (mutex_lock_interruptible(&p->lock)) {
+		return -ERESTARTSYS;
+	}
+	*c = p->cipher;
+	mutex_unlock(&p->lock);
+	return 0;
+}
+
+/*
+ * Don't sleep for O_NONBLOCK files or IOCB_NOWAIT requests (io_uring),
+ * say -EAGAIN and let them poll instead.
+ */
+static bool caesar_nowait(struct kiocb *iocb)
+{
+	return (iocb->ki_flags & IOCB_NOWAIT) || (iocb->ki_filp->f_flags & O_NONBLOCK);
+}
+
+/*
+ * Take @lock, one of the device's reader or writer locks, once @ready
+ * holds, waiting on @wq if it doesn't.
+ */
+static int caesar_lock_when(struct caesar_device *d, struct mutex *lock,
+		wait_queue_head_t *wq, bool (*ready)(struct caesar_device *d), bool nowait)
+{
+	for (;;) {
+		if (nowait) {
+			if (!mutex_trylock(lock))
+				return -EAGAIN;
+		} else if (mutex_lock_interruptible(lock)) {
+			return -ERESTARTSYS;
+		}
+		if (ready(d))
+			return 0;
+		mutex_unlock(lock);
+		if (nowait)
+			return -EAGAIN;
+		if (wait_event_interruptible(*wq, ready(d)))
+			return -ERESTARTSYS;
+	}
+}
+
+static bool caesar_readable(struct caesar_device *d)
+{
+	return caesar_ring_len(&d->ring) > 0;
+}
+
+static bool caesar_writable(struct caesar_device *d)
+{
+	return caesar_ring_len(&d->ring) < caesar_max_buffer;
+}
+
+/*
+ * Append to the stream: copy it all in a page at a time, then
+ * transform it in place, on several CPUs if it is large enough, and
+ * only then move the tail so readers see it. Takes as much as fits
+ * under caesar_max_buffer, waits for room when there is none.
+ */
+static ssize_t caesar_write_iter(struct kiocb *iocb, struct iov_iter *from)
+{
+	struct caesar_data *p = iocb->ki_filp->private_data;
+	struct caesar_device *d = p->dev;
+	struct caesar_ring *r = &d->ring;
+	size_t count = iov_iter_count(from);
+	size_t done = 0, len, off, copied, max;
+	struct caesar_cipher c;
+	struct page *page;
+	ssize_t retval;
+	u64 start, pos;
+
+	if (count == 0)
+		return 0;
+	retval = caesar_get_cipher(p, &c, caesar_nowait(iocb));
+	if (retval)
+		return retval;
+	retval = caesar_lock_when(d, &d->write_lock, &d->writeq, caesar_writable,
+			caesar_nowait(iocb));
+	if (retval)
+		return retval;
+	/* the limit may have shrunk since caesar_writable() said yes */
+	len = caesar_ring_len(r);
+	max = READ_ONCE(caesar_max_buffer);
+	count = min_t(size_t, count, max > len ? max - len : 0);
+	if (count == 0) {
+		/* a 0 would have write() loops spin */
+		mutex_unlock(&d->write_lock);
+		return caesar_nowait(iocb) ? -EAGAIN : -ENOSPC;
+	}
+
+	/* past the tail is ours alone until we move it */
+	start = pos = r->tail;
+	while (done < count) {
+		off = offset_in_page(pos);
+		len = min_t(size_t, PAGE_SIZE - off, count - done);
+		if (off == 0) {
+			retval = caesar_ring_add_page(d, pos);
+			if (retval)
+				break;
 		}
-		if (copy_from_user(p->data, buf, count)) {
-			printk(KERN_ALERT "%s:%d failed to copy_from_user\n", __func__, __LINE__);
+		page = *caesar_ring_slot(r, pos);
+		copied = copy_from_iter(page_address(page) + off, len, from);
+		if (copied == 0 && off == 0) {
+			spin_lock(&d->lock);
+			*caesar_ring_slot(r, pos) = NULL;
+			spin_unlock(&d->lock);
+			caesar_page_put(page);
+		}
+		pos += copied;
+		done += copied;
+		if (copied < len) {
 			retval = -EFAULT;
-			goto exit;
+			break;
 		}
-		retval = count;
-		for (i = 0; i < count; i++) {
-			if ('A' <= p->data[i] && p->data[i] <= 'Z') {
-				p->data[i] = 'A' + (p->data[i] + KEY - 'A') % 26;
-			} else if ('a' <= p->data[i] && p->data[i] <= 'z') {
-				p->data[i] = 'a' + (p->data[i] + KEY - 'a') % 26;
-			}
+		cond_resched();
+	}
+	caesar_transform_ring(&c, r, start, pos);
+	spin_lock(&d->lock);
+	WRITE_ONCE(r->tail, pos);
+	spin_unlock(&d->lock);
+	mutex_unlock(&d->write_lock);
+
+	if (done)
+		wake_up_interruptible_poll(&d->readq, EPOLLIN | EPOLLRDNORM);
+	return done ? done : retval;
+}
+
+/*
+ * Take bytes off the front of the stream, in order: whatever is there,
+ * up to what was asked for; waits for data when there is none. The
+ * copy out runs under the read lock alone, writers carry on meanwhile.
+ */
+static ssize_t caesar_read_iter(struct kiocb *iocb, struct iov_iter *to)
+{
+	struct caesar_data *p = iocb->ki_filp->private_data;
+	struct caesar_device *d = p->dev;
+	struct caesar_ring *r = &d->ring;
+	size_t count = iov_iter_count(to);
+	size_t done = 0, len, off, copied;
+	struct page *page;
+	ssize_t retval;
+
+	if (count == 0)
+		return 0;
+	retval = caesar_lock_when(d, &d->read_lock, &d->readq, caesar_readable,
+			caesar_nowait(iocb));
+	if (retval)
+		return retval;
+
+	count = min_t(size_t, count, caesar_ring_avail(d));
+	while (done < count) {
+		off = offset_in_page(r->head);
+		len = min_t(size_t, PAGE_SIZE - off, count - done);
+		page = caesar_ring_page(d, r->head);
+		copied = copy_to_iter(page_address(page) + off, len, to);
+		page = caesar_ring_consume(d, copied);
+		if (page)
+			caesar_page_put(page);
+		done += copied;
+		if (copied < len) {
+			retval = -EFAULT;
+			break;
 		}
+		cond_resched();
 	}
+	mutex_unlock(&d->read_lock);
 
-exit:
-	write_unlock(&p->lock);
+	if (done)
+		wake_up_interruptible_poll(&d->writeq, EPOLLOUT | EPOLLWRNORM);
+	return done ? done : retval;
+}
+
+/*
+ * splice() out of the stream without a copy: the ring pages go into
+ * the pipe as they are. Bytes before the tail never change again, so
+ * a page the writer is still filling can be shared; a page we are done
+ * with is simply handed over.
+ */
+static const struct pipe_buf_operations caesar_pipe_buf_ops = {
+	.release = generic_pipe_buf_release,
+	.try_steal = generic_pipe_buf_try_steal,
+	.get = generic_pipe_buf_get,
+};
+
+static ssize_t caesar_splice_read(struct file *in, loff_t *ppos,
+		struct pipe_inode_info *pipe, size_t len, unsigned int flags)
+{
+	struct caesar_data *p = in->private_data;
+	struct caesar_device *d = p->dev;
+	struct caesar_ring *r = &d->ring;
+	bool nowait = (flags & SPLICE_F_NONBLOCK) || (in->f_flags & O_NONBLOCK);
+	struct pipe_buffer buf;
+	struct page *page;
+	size_t done = 0, n, off;
+	ssize_t retval;
+
+	if (len == 0)
+		return 0;
+	retval = caesar_lock_when(d, &d->read_lock, &d->readq, caesar_readable, nowait);
+	if (retval)
+		return retval;
+
+	len = min_t(size_t, len, caesar_ring_avail(d));
+	retval = -EAGAIN; /* if the pipe is full already */
+	while (done < len && !pipe_full(pipe->head, pipe->tail, pipe->max_usage)) {
+		off = offset_in_page(r->head);
+		n = min_t(size_t, PAGE_SIZE - off, len - done);
+		buf = (struct pipe_buffer) {
+			.page = caesar_ring_page(d, r->head),
+			.offset = off,
+			.len = n,
+			.ops = &caesar_pipe_buf_ops,
+		};
+		/* the pipe's own reference, add_to_pipe() drops it on failure */
+		get_page(buf.page);
+		retval = add_to_pipe(pipe, &buf);
+		if (retval < 0)
+			break;
+		page = caesar_ring_consume(d, n);
+		if (page) {
+			/* done with this page, the pipe has the last reference */
+			put_page(page);
+		}
+		done += n;
+	}
+	mutex_unlock(&d->read_lock);
+
+	if (done)
+		wake_up_interruptible_poll(&d->writeq, EPOLLOUT | EPOLLWRNORM);
+	return done ? done : retval;
+}
+
+/* Readable when the stream has data, writable while it has room. */
+static __poll_t caesar_poll(struct file *filp, poll_table *wait)
+{
+	struct caesar_data *p = filp->private_data;
+	struct caesar_device *d = p->dev;
+	__poll_t mask = 0;
+
+	poll_wait(filp, &d->readq, wait);
+	poll_wait(filp, &d->writeq, wait);
+	if (caesar_readable(d))
+		mask |= EPOLLIN | EPOLLRDNORM;
+	if (caesar_writable(d))
+		mask |= EPOLLOUT | EPOLLWRNORM;
+	return mask;
+}
+
+/*
+ * CAESAR_TRANSFORM: run a user buffer through the cipher in place, a
+ * page at a time through a bounce page, with the key the handle had
+ * when the call started. One syscall instead of a write and a read.
+ */
+static long caesar_transform_user(struct caesar_data *p, const struct caesar_buf *b)
+{
+	char __user *ubuf = u64_to_user_ptr(b->addr);
+	struct caesar_cipher c;
+	u64 done = 0;
+	size_t len;
+	long retval;
+	char *page;
+
+	retval = caesar_get_cipher(p, &c, false);
+	if (retval)
+		return retval;
+
+	page = (char *)__get_free_page(GFP_KERNEL);
+	if (page == NULL)
+		return -ENOMEM;
+	while (done < b->len) {
+		len = min_t(u64, PAGE_SIZE, b->len - done);
+		if (copy_from_user(page, ubuf + done, len)) {
+			retval = -EFAULT;
+			break;
+		}
+		caesar_transform(&c, page, len);
+		if (copy_to_user(ubuf + done, page, len)) {
+			retval = -EFAULT;
+			break;
+		}
+		done += len;
+		if (fatal_signal_pending(current)) {
+			retval = -EINTR;
+			break;
+		}
+		cond_resched();
+	}
+	free_page((unsigned long)page);
 	return retval;
 }
 
-ssize_t caesar_read(struct file *filp, char __user *buf, size_t count, 
-		loff_t *f_ops)
+/*
+ * CAESAR_TRANSFORM_MAP: the same on a range of the mmap() buffer, so
+ * the data never crosses the user/kernel boundary.
+ */
+static long caesar_transform_map(struct caesar_data *p, const struct caesar_range *r)
+{
+	struct caesar_cipher c;
+	size_t size, len;
+	u64 done;
+	char *map;
+	long retval;
+
+	mutex_lock(&p->map_lock);
+	map = p->map;
+	size = p->map_size;
+	mutex_unlock(&p->map_lock);
+	/* once there, the buffer stays until the file is released */
+	if (map == NULL || r->offset > size || r->len > size - r->offset)
+		return -EINVAL;
+
+	retval = caesar_get_cipher(p, &c, false);
+	if (retval)
+		return retval;
+	map += r->offset;
+	if (caesar_parallel_min && r->len >= caesar_parallel_min) {
+		struct caesar_job job = {
+			.cipher = &c,
+			.buf = map,
+			.end = r->len,
+		};
+
+		caesar_job_run(&job);
+		return 0;
+	}
+	for (done = 0; done < r->len; done += len) {
+		len = min_t(u64, CAESAR_CHUNK, r->len - done);
+		caesar_transform(&c, map + done, len);
+		cond_resched();
+	}
+	return 0;
+}
+
+/*
+ * mmap: a buffer of the handle's own, shared with user space. The first
+ * mmap() sizes it (up to caesar_max_buffer), later ones must map the
+ * same size, and it lives until the file is released.
+ */
+static int caesar_mmap(struct file *filp, struct vm_area_struct *vma)
 {
-	ssize_t retval = 0;
 	struct caesar_data *p = filp->private_data;
+	unsigned long size = vma->vm_end - vma->vm_start;
+	int retval;
 
-	printk("%s: count %ld pos %lld\n", __func__, count, *f_ops);
+	/* a private copy would never see the transform */
+	if (!(vma->vm_flags & VM_SHARED))
+		return -EINVAL;
+	if (vma->vm_pgoff != 0 || size > caesar_max_buffer)
+		return -EINVAL;
 
-	read_lock(&p->lock);
-	if (copy_to_user(buf, p->data, count)) {
-		printk(KERN_ALERT "%s:%d failed to copy_to_user\n", __func__, __LINE__);
-		retval = -EFAULT;
+	mutex_lock(&p->map_lock);
+	if (p->map == NULL) {
+		p->map = vmalloc_user(size);
+		if (p->map == NULL) {
+			retval = -ENOMEM;
+			goto exit;
+		}
+		p->map_size = size;
+	} else if (size != p->map_size) {
+		retval = -EINVAL;
 		goto exit;
 	}
-	retval = count;
+	retval = remap_vmalloc_range(vma, p->map, 0);
 
 exit:
-	read_unlock(&p->lock);
+	mutex_unlock(&p->map_lock);
 	return retval;
 }
 
+static long caesar_ioctl(struct file *filp, unsigned int cmd, unsigned long arg)
+{
+	struct caesar_data *p = filp->private_data;
+	void __user *argp = (void __user *)arg;
+	struct caesar_key k;
+	struct caesar_buf b;
+	struct caesar_range r;
+
+	switch (cmd) {
+	case CAESAR_SET_KEY:
+		if (copy_from_user(&k, argp, sizeof(k)))
+			return -EFAULT;
+		if (k.decrypt > 1)
+			return -EINVAL;
+		if (mutex_lock_interruptible(&p->lock))
+			return -ERESTARTSYS;
+		/* applies to what is written from now on */
+		p->key = k.key;
+		p->decrypt = k.decrypt;
+		caesar_cipher_init(&p->cipher, caesar_shift(k.key, k.decrypt));
+		mutex_unlock(&p->lock);
+		return 0;
+	case CAESAR_GET_KEY:
+		if (mutex_lock_interruptible(&p->lock))
+			return -ERESTARTSYS;
+		k.key = p->key;
+		k.decrypt = p->decrypt;
+		mutex_unlock(&p->lock);
+		return copy_to_user(argp, &k, sizeof(k)) ? -EFAULT : 0;
+	case CAESAR_TRANSFORM:
+		if (copy_from_user(&b, argp, sizeof(b)))
+			return -EFAULT;
+		return caesar_transform_user(p, &b);
+	case CAESAR_TRANSFORM_MAP:
+		if (copy_from_user(&r, argp, sizeof(r)))
+			return -EFAULT;
+		return caesar_transform_map(p, &r);
+	default:
+		return -ENOTTY;
+	}
+}
+
+/*
+ * The crypto API side: "caesar", an skcipher with a one-byte key (taken
+ * modulo 26) and no IV, for kernel users and for AF_ALG. It walks the
+ * scatterlists and runs caesar_transform() on each mapped piece.
+ */
+struct caesar_tfm_ctx {
+	struct caesar_cipher enc;
+	struct caesar_cipher dec;
+};
+
+static int caesar_skcipher_setkey(struct crypto_skcipher *tfm, const u8 *key,
+		unsigned int keylen)
+{
+	struct caesar_tfm_ctx *ctx = crypto_skcipher_ctx(tfm);
+
+	if (keylen != 1)
+		return -EINVAL;
+	caesar_cipher_init(&ctx->enc, caesar_shift(key[0], false));
+	caesar_cipher_init(&ctx->dec, caesar_shift(key[0], true));
+	return 0;
+}
+
+static int caesar_skcipher_crypt(struct skcipher_request *req,
+		const struct caesar_cipher *c)
+{
+	struct skcipher_walk walk;
+	unsigned int n;
+	int err;
+
+	err = skcipher_walk_virt(&walk, req, false);
+	while ((n = walk.nbytes) != 0) {
+		if (walk.dst.virt.addr != walk.src.virt.addr)
+			memcpy(walk.dst.virt.addr, walk.src.virt.addr, n);
+		caesar_transform(c, walk.dst.virt.addr, n);
+		err = skcipher_walk_done(&walk, 0);
+	}
+	return err;
+}
+
+static int caesar_skcipher_encrypt(struct skcipher_request *req)
+{
+	struct caesar_tfm_ctx *ctx = crypto_skcipher_ctx(crypto_skcipher_reqtfm(req));
+
+	return caesar_skcipher_crypt(req, &ctx->enc);
+}
+
+static int caesar_skcipher_decrypt(struct skcipher_request *req)
+{
+	struct caesar_tfm_ctx *ctx = crypto_skcipher_ctx(crypto_skcipher_reqtfm(req));
+
+	return caesar_skcipher_crypt(req, &ctx->dec);
+}
+
+static struct skcipher_alg caesar_alg = {
+	.base = {
+		.cra_name = "caesar",
+		.cra_driver_name = "caesar-generic",
+		.cra_priority = 100,
+		.cra_blocksize = 1,
+		.cra_ctxsize = sizeof(struct caesar_tfm_ctx),
+		.cra_module = THIS_MODULE,
+	},
+	.min_keysize = 1,
+	.max_keysize = 1,
+	.setkey = caesar_skcipher_setkey,
+	.encrypt = caesar_skcipher_encrypt,
+	.decrypt = caesar_skcipher_decrypt,
+};
+
 static int caesar_open(struct inode *inode, struct file *file)
 {
 	struct caesar_data *p;
@@ -97,17 +1164,27 @@ static int caesar_open(struct inode *inode, struct file *file)
 			current->pid
 		  );
 
-	p = (struct caesar_data *)kmalloc(sizeof(struct caesar_data), GFP_KERNEL);
+	p = kmem_cache_alloc(caesar_cachep, GFP_KERNEL);
 	if (p == NULL) {
 		printk("%s:%d Not memory.\n", __func__, __LINE__);
 		return -ENOMEM;
 	}
-
+	/* every handle on this minor shares its stream */
+	p->dev = container_of(inode->i_cdev, struct caesar_device, cdev);
 	p->key = KEY;
-	rwlock_init(&p->lock);
+	p->decrypt = false;
+	caesar_cipher_init(&p->cipher, caesar_shift(KEY, false));
+	mutex_init(&p->lock);
+	mutex_init(&p->map_lock);
+	p->map = NULL;
+	p->map_size = 0;
 	
 	file->private_data = p;
 
+	/* a FIFO: no file position, no seeking */
+	stream_open(inode, file);
+	/* read_iter and write_iter honour IOCB_NOWAIT */
+	file->f_mode |= FMODE_NOWAIT;
 	return 0;
 }
 
@@ -121,8 +1198,10 @@ static int caesar_close(struct inode *inode, struct file *file)
 
 	if (file->private_data) {
 		struct caesar_data *p = file->private_data;
-		kfree(p->data);
-		kfree(file->private_data);
+		vfree(p->map);
+		mutex_destroy(&p->map_lock);
+		mutex_destroy(&p->lock);
+		kmem_cache_free(caesar_cachep, p);
 		file->private_data = NULL;
 	}
 	return 0;
@@ -131,80 +1210,149 @@ static int caesar_close(struct inode *inode, struct file *file)
 struct file_operations caesar_fops = {
 	.open = caesar_open,
 	.release = caesar_close,
-	.read = caesar_read,
-	.write = caesar_write,
+	.read_iter = caesar_read_iter,
+	.write_iter = caesar_write_iter,
+	.poll = caesar_poll,
+	.splice_read = caesar_splice_read,
+	/* pipe pages are copied into the ring and transformed there */
+	.splice_write = iter_file_splice_write,
+	.unlocked_ioctl = caesar_ioctl,
+	.compat_ioctl = compat_ptr_ioctl,
+	.mmap = caesar_mmap,
+	.llseek = no_llseek,
 };
 
+/* Set up minor @i: its stream, its cdev, then its /dev/caesar<i> node. */
+static int caesar_device_add(unsigned int i)
+{
+	struct caesar_device *d = &caesar_devices[i];
+	dev_t devt = MKDEV(caesar_major, i);
+	struct device *class_dev;
+	int err;
+
+	caesar_ring_init(&d->ring);
+	spin_lock_init(&d->lock);
+	mutex_init(&d->read_lock);
+	mutex_init(&d->write_lock);
+	init_waitqueue_head(&d->readq);
+	init_waitqueue_head(&d->writeq);
+
+	/* init character-type device with file operations */
+	cdev_init(&d->cdev, &caesar_fops);
+	d->cdev.owner = THIS_MODULE;
+	err = cdev_add(&d->cdev, devt, 1);
+	if (err)
+		return err;
+
+	class_dev = device_create(caesar_class, NULL, devt, NULL, "caesar%u", i);
+	if (IS_ERR(class_dev)) {
+		cdev_del(&d->cdev);
+		return PTR_ERR(class_dev);
+	}
+	return 0;
+}
+
+/* No handles are left, so whatever is still buffered goes too. */
+static void caesar_device_del(unsigned int i)
+{
+	struct caesar_device *d = &caesar_devices[i];
+
+	device_destroy(caesar_class, MKDEV(caesar_major, i));
+	cdev_del(&d->cdev);
+	caesar_ring_free(&d->ring);
+	mutex_destroy(&d->write_lock);
+	mutex_destroy(&d->read_lock);
+}
+
 static int caesar_init(void)
 {
-	/* create device number */
-#if 1
-	dev_t dev /*= MKDEV(caesar_major, 0)*/;
-#else
-	dev_t dev = MKDEV(caesar_major, 0);
-#endif
-	int alloc_ret = 0;
-	int major;
-	int cdev_err = 0;
-	struct device *class_dev = NULL;
+	dev_t dev;
+	unsigned int i;
+	int err;
 
-	/* dynamically allocate device number */
-	alloc_ret = alloc_chrdev_region(&dev, 0, caesar_devs, DRIVER_NAME);
-	if (alloc_ret) {
-		goto exit;
+	if (caesar_devs == 0 || caesar_devs > MINORMASK + 1)
+		return -EINVAL;
+	/* don't hand out a cipher that disagrees with itself */
+	err = caesar_setup_transform();
+	if (err)
+		return err;
+	/* opened and closed all the time: a cache of its own */
+	caesar_cachep = KMEM_CACHE(caesar_data, SLAB_HWCACHE_ALIGN | SLAB_ACCOUNT);
+	if (caesar_cachep == NULL)
+		return -ENOMEM;
+	/* large transforms: unbound, so the helpers stay near their memory */
+	caesar_wq = alloc_workqueue("caesar", WQ_UNBOUND | WQ_SYSFS, 0);
+	if (caesar_wq == NULL) {
+		err = -ENOMEM;
+		goto out_cache;
 	}
-	/* MAJOR(dev) returns major device number got by alloc_chrdev_region */
-	caesar_major = major = MAJOR(dev);
+	err = crypto_register_skcipher(&caesar_alg);
+	if (err)
+		goto out_wq;
 
-	/* init character-type device with file operations */
-	cdev_init(&caesar_cdev, &caesar_fops);
-	caesar_cdev.owner = THIS_MODULE;
-	caesar_cdev.ops = &caesar_fops;
+	/* dynamically allocate device number */
+	err = alloc_chrdev_region(&dev, 0, caesar_devs, DRIVER_NAME);
+	if (err)
+		goto out_alg;
+	/* MAJOR(dev) returns major device number got by alloc_chrdev_region */
+	caesar_major = MAJOR(dev);
 
 	/* register class */
-	caesar_class = class_create(THIS_MODULE, "caesar");
+	caesar_class = class_create("caesar");
 	if (IS_ERR(caesar_class)) {
-		goto exit;
+		err = PTR_ERR(caesar_class);
+		goto out_region;
 	}
 
-	//caesar_dev = MKDEV(caesar_major, 0);
-	class_dev = device_create(
-			caesar_class,
-			NULL,
-			MKDEV(caesar_major, 0),
-			NULL,
-			"caesar");
-
-	cdev_err = cdev_add(&caesar_cdev, MKDEV(caesar_major, 0), caesar_devs);
-	if (cdev_err) {
-		goto exit;
+	caesar_devices = kcalloc(caesar_devs, sizeof(*caesar_devices), GFP_KERNEL);
+	if (caesar_devices == NULL) {
+		err = -ENOMEM;
+		goto out_class;
+	}
+	for (i = 0; i < caesar_devs; i++) {
+		err = caesar_device_add(i);
+		if (err)
+			goto out_devices;
 	}
 
-	printk(KERN_ALERT "%s driver(major %d) installed.\n", DRIVER_NAME, major);
+	printk(KERN_ALERT "%s driver(major %d, %u minors) installed.\n",
+			DRIVER_NAME, caesar_major, caesar_devs);
 
 	return 0;
 
-exit:
-	if (cdev_err == 0) {
-		cdev_del(&caesar_cdev);
-	}
-	if (alloc_ret == 0) {
-		unregister_chrdev_region(dev, caesar_devs);
-	}
-	return -1;
+out_devices:
+	while (i--)
+		caesar_device_del(i);
+	kfree(caesar_devices);
+out_class:
+	class_destroy(caesar_class);
+out_region:
+	unregister_chrdev_region(dev, caesar_devs);
+out_alg:
+	crypto_unregister_skcipher(&caesar_alg);
+out_wq:
+	destroy_workqueue(caesar_wq);
+out_cache:
+	kmem_cache_destroy(caesar_cachep);
+	caesar_pool_drain();
+	return err;
 }
 
 static void caesar_exit(void)
 {
-	/* get device number */
-	dev_t dev = MKDEV(caesar_major, 0);
+	unsigned int i;
 
-	/* unregister class */ 
-	device_destroy(caesar_class, MKDEV(caesar_major, 0));
+	for (i = 0; i < caesar_devs; i++)
+		caesar_device_del(i);
+	kfree(caesar_devices);
+	/* unregister class */
 	class_destroy(caesar_class);
+	unregister_chrdev_region(MKDEV(caesar_major, 0), caesar_devs);
 
-	cdev_del(&caesar_cdev);
-	unregister_chrdev_region(dev, caesar_devs);
+	crypto_unregister_skcipher(&caesar_alg);
+	destroy_workqueue(caesar_wq);
+	kmem_cache_destroy(caesar_cachep);
+	caesar_pool_drain();
 
 	printk(KERN_ALERT "%s driver removed.\n", DRIVER_NAME);
 }
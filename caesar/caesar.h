@@ -0,0 +1,35 @@
+/*
+ * ioctls of /dev/caesar<n>, shared by the driver and app.c
+ */
+#ifndef _CAESAR_H
+#define _CAESAR_H
+
+#include <linux/ioctl.h>
+#include <linux/types.h>
+
+#define CAESAR_IOC_MAGIC 'c'
+
+/* the cipher of one open file */
+struct caesar_key {
+	__s32 key; /* places to shift letters by, taken modulo 26 */
+	__u32 decrypt; /* 1: shift back instead */
+};
+
+/* a user buffer, transformed in place */
+struct caesar_buf {
+	__u64 addr;
+	__u64 len;
+};
+
+/* a range of the buffer mapped with mmap(), transformed in place */
+struct caesar_range {
+	__u64 offset;
+	__u64 len;
+};
+
+#define CAESAR_SET_KEY _IOW(CAESAR_IOC_MAGIC, 1, struct caesar_key)
+#define CAESAR_GET_KEY _IOR(CAESAR_IOC_MAGIC, 2, struct caesar_key)
+#define CAESAR_TRANSFORM _IOW(CAESAR_IOC_MAGIC, 3, struct caesar_buf)
+#define CAESAR_TRANSFORM_MAP _IOW(CAESAR_IOC_MAGIC, 4, struct caesar_range)
+
+#endif /* _CAESAR_H */
@@ -0,0 +1,401 @@
+/*
+ * bench: blast UDP frames through a snull pair and report how fast
+ * they come out the other end.
+ *
+ * Frames are injected on the TX device with an AF_PACKET socket and
+ * sendmmsg(); the RX side is measured from the device counters, so the
+ * receiver costs nothing. Needs root (CAP_NET_RAW) and both devices up:
+ *
+ *   ifconfig sn0 local0; ifconfig sn1 local1
+ *   ./bench -s 64 -f 16 -d 10
+ *
+ * The default addresses follow the snull convention: 192.168.0.1 sends
+ * to 192.168.0.2, which the pair rewrites into 192.168.1.2 (sn1).
+ */
+#define _GNU_SOURCE /* sendmmsg */
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <unistd.h>
+#include <errno.h>
+#include <getopt.h>
+#include <time.h>
+#include <sys/socket.h>
+#include <sys/ioctl.h>
+#include <sys/syscall.h>
+#include <arpa/inet.h>
+#include <net/if.h>
+#include <netinet/in.h>
+#include <netinet/ip.h>
+#include <netinet/udp.h>
+#include <linux/if_ether.h>
+#include <linux/if_packet.h>
+#include <linux/perf_event.h>
+
+#define MAX_FRAME 9000
+#define MAX_FLOWS 4096
+#define MAX_BATCH 1024
+#define MAX_CPUS 1024
+#define UDP_PORT 9 /* discard */
+
+struct config {
+	const char *txdev;
+	const char *rxdev;
+	int size; /* Ethernet frame, without FCS */
+	int flows;
+	int batch;
+	double duration;
+	int bypass; /* PACKET_QDISC_BYPASS */
+	int json;
+	struct in_addr saddr;
+	struct in_addr daddr;
+};
+
+/* the counters we sample from /sys/class/net/<dev>/statistics */
+struct devstats {
+	unsigned long long rx_packets;
+	unsigned long long rx_bytes;
+	unsigned long long rx_dropped;
+	unsigned long long tx_dropped;
+};
+
+static void usage(const char *prog)
+{
+	fprintf(stderr,
+		"usage: %s [-i txdev] [-o rxdev] [-s size] [-f flows] [-b batch]\n"
+		"          [-d seconds] [-S saddr] [-D daddr] [-q] [-j]\n"
+		"  -i txdev   inject on this device (sn0)\n"
+		"  -o rxdev   count what comes out of this one (sn1)\n"
+		"  -s size    Ethernet frame size, %d..%d (64)\n"
+		"  -f flows   distinct UDP source ports, spread over the queues (1)\n"
+		"  -b batch   frames per sendmmsg() call (32)\n"
+		"  -d seconds how long to send (5)\n"
+		"  -S/-D      IPv4 source/destination (192.168.0.1/192.168.0.2)\n"
+		"  -q         bypass the qdisc (PACKET_QDISC_BYPASS)\n"
+		"  -j         one JSON object on stdout, for scripts\n",
+		prog, (int)(ETH_HLEN + sizeof(struct iphdr) + sizeof(struct udphdr)),
+		MAX_FRAME);
+	exit(EXIT_FAILURE);
+}
+
+static double now(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+static unsigned long long read_counter(const char *dev, const char *name)
+{
+	char path[256];
+	unsigned long long val = 0;
+	FILE *fp;
+
+	snprintf(path, sizeof(path), "/sys/class/net/%s/statistics/%s", dev, name);
+	fp = fopen(path, "r");
+	if (fp == NULL) {
+		perror(path);
+		exit(EXIT_FAILURE);
+	}
+	if (fscanf(fp, "%llu", &val) != 1)
+		val = 0;
+	fclose(fp);
+	return val;
+}
+
+static void read_stats(const char *dev, struct devstats *s)
+{
+	s->rx_packets = read_counter(dev, "rx_packets");
+	s->rx_bytes = read_counter(dev, "rx_bytes");
+	s->rx_dropped = read_counter(dev, "rx_dropped");
+	s->tx_dropped = read_counter(dev, "tx_dropped");
+}
+
+static int get_hwaddr(int sock, const char *dev, unsigned char *addr)
+{
+	struct ifreq ifr;
+
+	memset(&ifr, 0, sizeof(ifr));
+	strncpy(ifr.ifr_name, dev, IFNAMSIZ - 1);
+	if (ioctl(sock, SIOCGIFHWADDR, &ifr) < 0) {
+		perror(dev);
+		return -1;
+	}
+	memcpy(addr, ifr.ifr_hwaddr.sa_data, ETH_ALEN);
+	return 0;
+}
+
+static uint16_t ip_csum(const void *data, int len)
+{
+	const uint16_t *p = data;
+	uint32_t sum = 0;
+
+	for (; len > 1; len -= 2)
+		sum += *p++;
+	while (sum >> 16)
+		sum = (sum & 0xffff) + (sum >> 16);
+	return ~sum;
+}
+
+/*
+ * One Ethernet/IPv4/UDP frame per flow, flows differ by source port.
+ * The UDP checksum is left at 0 (none), the pair fixes the IP one.
+ */
+static unsigned char *build_frames(struct config *cfg,
+		const unsigned char *src, const unsigned char *dst)
+{
+	unsigned char *frames, *f;
+	struct ethhdr *eth;
+	struct iphdr *ip;
+	struct udphdr *udp;
+	int i;
+
+	frames = calloc(cfg->flows, cfg->size);
+	if (frames == NULL) {
+		perror("calloc");
+		exit(EXIT_FAILURE);
+	}
+	for (i = 0; i < cfg->flows; i++) {
+		f = frames + (size_t)i * cfg->size;
+		eth = (struct ethhdr *)f;
+		ip = (struct iphdr *)(eth + 1);
+		udp = (struct udphdr *)(ip + 1);
+
+		memcpy(eth->h_dest, dst, ETH_ALEN);
+		memcpy(eth->h_source, src, ETH_ALEN);
+		eth->h_proto = htons(ETH_P_IP);
+
+		ip->version = 4;
+		ip->ihl = 5;
+		ip->tot_len = htons(cfg->size - ETH_HLEN);
+		ip->ttl = 64;
+		ip->protocol = IPPROTO_UDP;
+		ip->saddr = cfg->saddr.s_addr;
+		ip->daddr = cfg->daddr.s_addr;
+		ip->check = ip_csum(ip, sizeof(*ip));
+
+		udp->source = htons(1024 + i);
+		udp->dest = htons(UDP_PORT);
+		udp->len = htons(cfg->size - ETH_HLEN - sizeof(*ip));
+		udp->check = 0;
+	}
+	return frames;
+}
+
+/*
+ * System-wide CPU cycles, one counter per CPU, so the softirq and NAPI
+ * work on the receiving side is accounted for too. Returns the number
+ * of counters opened, 0 if the PMU is not available to us.
+ */
+static int open_cycles(int *fds)
+{
+	struct perf_event_attr attr;
+	int cpu, ncpus = sysconf(_SC_NPROCESSORS_ONLN);
+
+	if (ncpus > MAX_CPUS)
+		ncpus = MAX_CPUS;
+	memset(&attr, 0, sizeof(attr));
+	attr.size = sizeof(attr);
+	attr.type = PERF_TYPE_HARDWARE;
+	attr.config = PERF_COUNT_HW_CPU_CYCLES;
+	attr.disabled = 1;
+	for (cpu = 0; cpu < ncpus; cpu++) {
+		fds[cpu] = syscall(__NR_perf_event_open, &attr, -1, cpu, -1, 0);
+		if (fds[cpu] < 0) {
+			while (--cpu >= 0)
+				close(fds[cpu]);
+			return 0;
+		}
+	}
+	return ncpus;
+}
+
+static void toggle_cycles(int *fds, int n, int on)
+{
+	int i;
+
+	for (i = 0; i < n; i++)
+		ioctl(fds[i], on ? PERF_EVENT_IOC_ENABLE : PERF_EVENT_IOC_DISABLE, 0);
+}
+
+static unsigned long long read_cycles(int *fds, int n)
+{
+	unsigned long long total = 0, val;
+	int i;
+
+	for (i = 0; i < n; i++) {
+		if (read(fds[i], &val, sizeof(val)) == sizeof(val))
+			total += val;
+		close(fds[i]);
+	}
+	return total;
+}
+
+int main(int argc, char *argv[])
+{
+	struct config cfg = {
+		.txdev = "sn0",
+		.rxdev = "sn1",
+		.size = 64,
+		.flows = 1,
+		.batch = 32,
+		.duration = 5,
+	};
+	static struct mmsghdr msgs[MAX_BATCH];
+	static struct iovec iovs[MAX_BATCH];
+	static int cycle_fds[MAX_CPUS];
+	unsigned char src[ETH_ALEN], dst[ETH_ALEN], *frames;
+	struct devstats tx0, tx1, rx0, rx1;
+	struct sockaddr_ll sll;
+	unsigned long long sent = 0, errors = 0, cycles = 0;
+	unsigned long long rx_pkts, rx_bytes, tx_drops, rx_drops;
+	double start, elapsed, pps, gbps, cpp;
+	int sock, opt, ret, i, ncycles, flow = 0;
+	int one = 1;
+
+	inet_aton("192.168.0.1", &cfg.saddr);
+	inet_aton("192.168.0.2", &cfg.daddr);
+
+	while ((opt = getopt(argc, argv, "i:o:s:f:b:d:S:D:qjh")) != -1) {
+		switch (opt) {
+		case 'i':
+			cfg.txdev = optarg;
+			break;
+		case 'o':
+			cfg.rxdev = optarg;
+			break;
+		case 's':
+			cfg.size = atoi(optarg);
+			break;
+		case 'f':
+			cfg.flows = atoi(optarg);
+			break;
+		case 'b':
+			cfg.batch = atoi(optarg);
+			break;
+		case 'd':
+			cfg.duration = atof(optarg);
+			break;
+		case 'S':
+			if (!inet_aton(optarg, &cfg.saddr))
+				usage(argv[0]);
+			break;
+		case 'D':
+			if (!inet_aton(optarg, &cfg.daddr))
+				usage(argv[0]);
+			break;
+		case 'q':
+			cfg.bypass = 1;
+			break;
+		case 'j':
+			cfg.json = 1;
+			break;
+		default:
+			usage(argv[0]);
+		}
+	}
+	if (cfg.size < (int)(ETH_HLEN + sizeof(struct iphdr) + sizeof(struct udphdr)) ||
+			cfg.size > MAX_FRAME || cfg.flows < 1 || cfg.flows > MAX_FLOWS ||
+			cfg.batch < 1 || cfg.batch > MAX_BATCH || cfg.duration <= 0)
+		usage(argv[0]);
+
+	sock = socket(AF_PACKET, SOCK_RAW, 0); /* TX only: no protocol, no RX */
+	if (sock < 0) {
+		perror("socket");
+		exit(EXIT_FAILURE);
+	}
+	if (get_hwaddr(sock, cfg.txdev, src) || get_hwaddr(sock, cfg.rxdev, dst))
+		exit(EXIT_FAILURE);
+
+	memset(&sll, 0, sizeof(sll));
+	sll.sll_family = AF_PACKET;
+	sll.sll_protocol = 0; /* no packet handler: the socket never reads */
+	sll.sll_ifindex = if_nametoindex(cfg.txdev);
+	if (sll.sll_ifindex == 0 || bind(sock, (struct sockaddr *)&sll, sizeof(sll)) < 0) {
+		perror("bind");
+		exit(EXIT_FAILURE);
+	}
+	if (cfg.bypass &&
+			setsockopt(sock, SOL_PACKET, PACKET_QDISC_BYPASS, &one, sizeof(one)) < 0) {
+		perror("PACKET_QDISC_BYPASS");
+		exit(EXIT_FAILURE);
+	}
+
+	frames = build_frames(&cfg, src, dst);
+	for (i = 0; i < cfg.batch; i++) {
+		iovs[i].iov_len = cfg.size;
+		msgs[i].msg_hdr.msg_iov = &iovs[i];
+		msgs[i].msg_hdr.msg_iovlen = 1;
+	}
+
+	ncycles = open_cycles(cycle_fds);
+	read_stats(cfg.txdev, &tx0);
+	read_stats(cfg.rxdev, &rx0);
+	toggle_cycles(cycle_fds, ncycles, 1);
+	start = now();
+
+	do {
+		for (i = 0; i < cfg.batch; i++) {
+			iovs[i].iov_base = frames + (size_t)flow * cfg.size;
+			if (++flow == cfg.flows)
+				flow = 0;
+		}
+		ret = sendmmsg(sock, msgs, cfg.batch, 0);
+		if (ret < 0) {
+			/* a full qdisc or TX ring, try again */
+			if (errno != ENOBUFS && errno != EAGAIN && errno != EINTR) {
+				perror("sendmmsg");
+				break;
+			}
+			errors++;
+			continue;
+		}
+		sent += ret;
+	} while (now() - start < cfg.duration);
+	elapsed = now() - start;
+
+	/* let what is still on the (emulated) wire arrive */
+	usleep(100000);
+	toggle_cycles(cycle_fds, ncycles, 0);
+	read_stats(cfg.txdev, &tx1);
+	read_stats(cfg.rxdev, &rx1);
+	if (ncycles)
+		cycles = read_cycles(cycle_fds, ncycles);
+
+	rx_pkts = rx1.rx_packets - rx0.rx_packets;
+	rx_bytes = rx1.rx_bytes - rx0.rx_bytes;
+	tx_drops = tx1.tx_dropped - tx0.tx_dropped;
+	rx_drops = rx1.rx_dropped - rx0.rx_dropped;
+	pps = rx_pkts / elapsed;
+	gbps = rx_bytes * 8 / elapsed / 1e9;
+	cpp = ncycles && rx_pkts ? (double)cycles / rx_pkts : -1;
+
+	if (cfg.json) {
+		printf("{\"txdev\":\"%s\",\"rxdev\":\"%s\",\"frame_size\":%d,"
+			"\"flows\":%d,\"batch\":%d,\"qdisc_bypass\":%d,"
+			"\"duration_s\":%.3f,\"sent\":%llu,\"send_errors\":%llu,"
+			"\"rx_packets\":%llu,\"rx_bytes\":%llu,"
+			"\"tx_dropped\":%llu,\"rx_dropped\":%llu,"
+			"\"pps\":%.0f,\"gbps\":%.3f,\"cycles_per_packet\":%.1f}\n",
+			cfg.txdev, cfg.rxdev, cfg.size, cfg.flows, cfg.batch, cfg.bypass,
+			elapsed, sent, errors, rx_pkts, rx_bytes, tx_drops, rx_drops,
+			pps, gbps, cpp);
+	} else {
+		printf("%s -> %s: %d byte frames, %d flows, batch %d, %.2f s\n",
+			cfg.txdev, cfg.rxdev, cfg.size, cfg.flows, cfg.batch, elapsed);
+		printf("sent %llu (%llu send errors), received %llu\n",
+			sent, errors, rx_pkts);
+		printf("%.3f Mpps, %.3f Gbit/s, dropped: tx %llu rx %llu\n",
+			pps / 1e6, gbps, tx_drops, rx_drops);
+		if (cpp >= 0)
+			printf("%.1f cycles/packet (all CPUs)\n", cpp);
+		else
+			printf("cycles/packet: n/a (no access to the cycle counters)\n");
+	}
+
+	free(frames);
+	close(sock);
+	return EXIT_SUCCESS;
+}
@@ -12,9 +12,33 @@
 #include <linux/in.h>
 #include <linux/ip.h>
 #include <linux/tcp.h>
+#include <linux/udp.h>
+#include <net/checksum.h>
 #include <net/arp.h>
 #include <linux/interrupt.h>
 #include <linux/skbuff.h>
+#include <linux/cpumask.h>
+#include <linux/rtnetlink.h>
+#include <linux/u64_stats_sync.h>
+#include <linux/hrtimer.h>
+#include <linux/irq_work.h>
+#include <linux/ktime.h>
+#include <linux/hashtable.h>
+#include <linux/refcount.h>
+#include <net/rtnetlink.h>
+#include <linux/debugfs.h>
+#include <linux/seq_file.h>
+#include <linux/log2.h>
+
+#include <linux/bpf.h>
+#include <linux/bpf_trace.h>
+#include <linux/filter.h>
+#include <net/xdp.h>
+#include <net/page_pool/helpers.h>
+
+/* last: everything above must see the kernel's tracepoints, not copies */
+#define CREATE_TRACE_POINTS
+#include "snull_trace.h"
 
 MODULE_AUTHOR("Hiroki Watanabe");
 MODULE_LICENSE("Dual BSD/GPL");
@@ -23,7 +47,20 @@ MODULE_LICENSE("Dual BSD/GPL");
 #define SNULL_RX_INTR 0x0001
 #define SNULL_TX_INTR 0x0002
 
-struct net_device *snull_devs[2];
+/*
+ * Pairs created at load time, more can be added with
+ * "ip link add type snull".
+ */
+static int pairs = 1;
+module_param(pairs, int, 0);
+
+/*
+ * Switch mode: create one N-port learning switch instead of the pairs.
+ */
+static int switch_ports = 0;
+module_param(switch_ports, int, 0);
+
+#define SNULL_MAX_PORTS 256
 
 /*
  * Transmitter lockup simulation, normally disabled.
@@ -34,31 +71,254 @@ module_param(lockup, int, 0);
 static int timeout = 5; /* in jiffies */
 module_param(timeout, int, 0);
 
+/*
+ * Link emulation, normally disabled: the bandwidth of each direction
+ * of the wire in Mbit/s, and its propagation delay in microseconds.
+ */
+static int bandwidth = 0;
+module_param(bandwidth, int, 0);
+static int latency = 0;
+module_param(latency, int, 0);
+
+/* preamble, FCS and inter-frame gap take wire time too */
+#define SNULL_WIRE_OVERHEAD 24
+
+/*
+ * Initial number of TX buffers per queue. An empty pool grows on demand
+ * up to the TX ring size and shrinks back when buffers sit idle.
+ * Ring sizes are set with ethtool -G.
+ */
 int pool_size = 8;
 module_param(pool_size, int, 0);
 
+#define SNULL_DEF_RING 256
+#define SNULL_MAX_RING 4096
+
 /*
- * A structure representing an in-flight packet.
+ * Frames up to SNULL_BUF_LEN are copied into a page_pool fragment,
+ * anything bigger (jumbo MTU, GSO) is handed to the peer as the skb
+ * itself. The fragment leaves room for build_skb() on the RX side.
+ */
+#define SNULL_BUF_LEN ETH_FRAME_LEN
+#define SNULL_HEADROOM (NET_SKB_PAD + NET_IP_ALIGN)
+#define SNULL_TRUESIZE(len) (SKB_DATA_ALIGN(SNULL_HEADROOM + (len)) + \
+		SKB_DATA_ALIGN(sizeof(struct skb_shared_info)))
+#define SNULL_MAX_MTU (ETH_MAX_MTU - ETH_HLEN)
+
+/*
+ * XDP runs on one page per frame: headroom, frame, skb_shared_info.
+ */
+#define SNULL_XDP_MAX_LEN (PAGE_SIZE - XDP_PACKET_HEADROOM - \
+		SKB_DATA_ALIGN(sizeof(struct skb_shared_info)))
+#define SNULL_XDP_MAX_MTU (SNULL_XDP_MAX_LEN - ETH_HLEN)
+
+#define SNULL_FEATURES (NETIF_F_SG | NETIF_F_FRAGLIST | NETIF_F_HW_CSUM | \
+		NETIF_F_RXCSUM | NETIF_F_HIGHDMA | NETIF_F_GSO_SOFTWARE)
+
+/*
+ * Number of TX/RX queue pairs per device, 0 means one per online CPU.
+ */
+static int num_queues = 0;
+module_param(num_queues, int, 0);
+
+#define SNULL_MAX_QUEUES 64
+
+/*
+ * A structure representing an in-flight packet. It is only a
+ * descriptor: the frame lives in a page_pool fragment, a handed-over
+ * skb or an XDP frame, exactly one of which is set.
  */
 struct snull_packet {
-	struct snull_packet *next;
-	struct net_device *dev;
+	struct snull_queue *queue; /* the TX queue owning this buffer */
+	struct sk_buff *skb;
+	struct xdp_frame *frame;
+	struct page *page; /* page_pool fragment of the TX queue */
+	unsigned int offset;
+	unsigned int truesize;
 	int	datalen;
-	u8 data[ETH_DATA_LEN];
+	ktime_t stamp; /* when it was put in the RX ring */
+	ktime_t arrival; /* when the last bit reaches the peer */
+};
+
+/*
+ * Single-producer/single-consumer ring of packet pointers. Only the
+ * producer writes head and only the consumer writes tail; they sit on
+ * separate cache lines so the two sides never bounce a line between
+ * them except to publish an entry.
+ */
+struct snull_ring {
+	struct snull_packet **slots;
+	unsigned int mask; /* size - 1, size is a power of two */
+	unsigned int head ____cacheline_aligned_in_smp;
+	unsigned int tail ____cacheline_aligned_in_smp;
 };
 
+/* snull_queue.state bits */
+#define SNULL_POOL_STOPPED 0
 
-/* private data structure to each device */
-struct snull_priv {
-	struct net_device_stats stats;
+/*
+ * Device counters, kept per CPU. The first six feed ndo_get_stats64,
+ * all of them are reported by ethtool -S.
+ */
+enum snull_stat {
+	SNULL_STAT_RX_PACKETS,
+	SNULL_STAT_RX_BYTES,
+	SNULL_STAT_RX_DROPPED,
+	SNULL_STAT_TX_PACKETS,
+	SNULL_STAT_TX_BYTES,
+	SNULL_STAT_TX_DROPPED,
+	SNULL_STAT_POOL_EMPTY,
+	SNULL_STAT_POOL_GROW,
+	SNULL_STAT_POOL_SHRINK,
+	SNULL_STAT_QUEUE_STOPPED,
+	SNULL_STAT_LOCKUP,
+	SNULL_STAT_XDP_PASS,
+	SNULL_STAT_XDP_DROP,
+	SNULL_STAT_XDP_TX,
+	SNULL_STAT_XDP_REDIRECT,
+	SNULL_STAT_XDP_XMIT,
+	/* TX drops by reason */
+	SNULL_STAT_TX_DROP_NOMEM,
+	SNULL_STAT_TX_DROP_NO_BUFFER,
+	SNULL_STAT_TX_DROP_PEER_DOWN,
+	SNULL_STAT_TX_DROP_RING_FULL,
+	SNULL_STAT_TX_DROP_RUNT,
+	SNULL_STAT_TX_DROP_HAIRPIN,
+	/* RX drops by reason */
+	SNULL_STAT_RX_DROP_NOMEM,
+	SNULL_STAT_RX_DROP_FORWARD,
+	SNULL_STAT_RX_DROP_FLUSH,
+	SNULL_STAT_RX_DROP_XDP,
+	SNULL_STAT_NUM,
+};
+
+static const char snull_stat_strings[SNULL_STAT_NUM][ETH_GSTRING_LEN] = {
+	[SNULL_STAT_RX_PACKETS] = "rx_packets",
+	[SNULL_STAT_RX_BYTES] = "rx_bytes",
+	[SNULL_STAT_RX_DROPPED] = "rx_dropped",
+	[SNULL_STAT_TX_PACKETS] = "tx_packets",
+	[SNULL_STAT_TX_BYTES] = "tx_bytes",
+	[SNULL_STAT_TX_DROPPED] = "tx_dropped",
+	[SNULL_STAT_POOL_EMPTY] = "pool_empty",
+	[SNULL_STAT_POOL_GROW] = "pool_grow",
+	[SNULL_STAT_POOL_SHRINK] = "pool_shrink",
+	[SNULL_STAT_QUEUE_STOPPED] = "queue_stopped",
+	[SNULL_STAT_LOCKUP] = "lockup",
+	[SNULL_STAT_XDP_PASS] = "xdp_pass",
+	[SNULL_STAT_XDP_DROP] = "xdp_drop",
+	[SNULL_STAT_XDP_TX] = "xdp_tx",
+	[SNULL_STAT_XDP_REDIRECT] = "xdp_redirect",
+	[SNULL_STAT_XDP_XMIT] = "xdp_xmit",
+	[SNULL_STAT_TX_DROP_NOMEM] = "tx_drop_nomem",
+	[SNULL_STAT_TX_DROP_NO_BUFFER] = "tx_drop_no_buffer",
+	[SNULL_STAT_TX_DROP_PEER_DOWN] = "tx_drop_peer_down",
+	[SNULL_STAT_TX_DROP_RING_FULL] = "tx_drop_ring_full",
+	[SNULL_STAT_TX_DROP_RUNT] = "tx_drop_runt",
+	[SNULL_STAT_TX_DROP_HAIRPIN] = "tx_drop_hairpin",
+	[SNULL_STAT_RX_DROP_NOMEM] = "rx_drop_nomem",
+	[SNULL_STAT_RX_DROP_FORWARD] = "rx_drop_forward",
+	[SNULL_STAT_RX_DROP_FLUSH] = "rx_drop_flush",
+	[SNULL_STAT_RX_DROP_XDP] = "rx_drop_xdp",
+};
+
+struct snull_pcpu_stats {
+	u64_stats_t cnt[SNULL_STAT_NUM];
+	struct u64_stats_sync syncp;
+};
+
+/*
+ * One TX/RX queue pair. Each queue has its own packet pool, RX ring,
+ * "interrupt" status and lock, so flows spread over different queues
+ * never touch the same cache line.
+ *
+ * TX queue i only ever feeds the peer's RX queue i, which makes both
+ * rings single-producer/single-consumer: the pool is filled by the
+ * peer's RX queue i and drained by our xmit on TX queue i, the RX ring
+ * is filled by the peer's xmit on TX queue i and drained by our RX
+ * handling. The lock only guards the status word now.
+ *
+ * On a switch port every other port feeds our RX queue i and returns
+ * buffers to our pool, so the producer side of both rings is then
+ * serialized by rx_lock and pool_lock ("shared").
+ */
+#define SNULL_LAT_BUCKETS 64
+
+struct snull_queue {
+	struct net_device *dev;
+	int index;
 	int status;
-	struct snull_packet *ppool;
-	struct snull_packet *rx_queue;  /* List of incoming packets */
+	unsigned long state;
+	struct snull_ring pool;
+	struct page_pool *page_pool;
+	unsigned int nr_buffers; /* descriptors we own, in the pool or in flight */
+	unsigned int pool_min;
+	unsigned int pool_low; /* fewest free descriptors since the last shrink check */
+	unsigned long pool_next_shrink;
+	struct snull_ring rx_ring;  /* incoming packets, FIFO */
 	int rx_int_enabled;
-	int tx_packetlen;
-	u8 *tx_packetdata;
-	struct sk_buff *skb;
+	unsigned long lat_hist[SNULL_LAT_BUCKETS]; /* log2 ns, ring to delivery */
+	struct hrtimer rx_timer; /* delayed RX interrupt */
+	unsigned int coal_frames; /* packets since the last RX interrupt */
+	ktime_t coal_first; /* arrival of the first of them */
+	struct sk_buff_head tx_pending; /* queued by xmit, waiting for the doorbell */
+	struct sk_buff_head tx_done; /* on the wire, freed at TX completion */
+	unsigned int tx_done_pkts; /* BQL accounting of the unreported batch */
+	unsigned int tx_done_bytes;
+	unsigned long tx_seq; /* packets handed to snull_hw_tx, for lockup */
+	int cpu; /* the CPU its interrupt is routed to */
+	struct irq_work irq; /* the interrupt line, see snull_raise_irq */
+	struct tasklet_struct bh; /* regular mode: the handler proper */
+	struct napi_struct napi;
+	struct xdp_rxq_info xdp_rxq;
+	struct page *xdp_page; /* spare page recycled from XDP_DROP */
+	bool shared;
+	spinlock_t rx_lock;
+	spinlock_t pool_lock;
 	spinlock_t lock;
+} ____cacheline_aligned_in_smp;
+
+/*
+ * Forwarding database of the switch: MAC address to port, hashed so a
+ * lookup costs the same whatever the number of ports and stations.
+ * Readers run under RCU; entries are only added (up to SNULL_FDB_MAX)
+ * and updated in place, stale ones are ignored and relearnt.
+ */
+#define SNULL_FDB_BITS 10
+#define SNULL_FDB_MAX 4096
+#define SNULL_FDB_AGE (300 * HZ)
+
+struct snull_fdb {
+	struct hlist_node hlist;
+	struct rcu_head rcu;
+	struct net_device *port;
+	unsigned long used;
+	u8 addr[ETH_ALEN];
+};
+
+struct snull_switch {
+	refcount_t refs; /* one per registered port */
+	spinlock_t lock; /* fdb updates */
+	unsigned int fdb_count;
+	DECLARE_HASHTABLE(fdb, SNULL_FDB_BITS);
+	int nr_ports;
+	struct net_device *ports[];
+};
+
+/* private data structure to each device */
+struct snull_priv {
+	struct snull_pcpu_stats __percpu *stats;
+	int num_queues;
+	unsigned int rx_ring_size;
+	unsigned int tx_ring_size;
+	u32 rx_usecs; /* ethtool -C */
+	u32 rx_frames;
+	atomic64_t link_busy; /* ns: the wire is free again */
+	bool resizing; /* pools and rings being replaced, see snull_set_ringparam */
+	struct bpf_prog __rcu *xdp_prog;
+	struct net_device __rcu *peer; /* pair mode */
+	struct snull_switch *sw; /* switch mode */
+	struct dentry *debugfs;
+	struct snull_queue *queues;
 };
 
 
@@ -68,250 +328,1666 @@ struct snull_priv {
 static int use_napi = 0;
 module_param(use_napi, int, 0);
 
+/*
+ * Run the NAPI poll loops in per-queue kernel threads instead of softirq.
+ */
+static int napi_threaded = 0;
+module_param(napi_threaded, int, 0);
+
+/*
+ * Zero-copy mode: hand the transmitted skb itself to the peer instead
+ * of copying it into a pool buffer and again into a fresh RX skb.
+ */
+static int zerocopy = 0;
+module_param(zerocopy, int, 0);
+
+/*
+ * Ring the TX doorbell at least every tx_doorbell packets, even while
+ * the stack says more are coming (xmit_more).
+ */
+static int tx_doorbell = 32;
+module_param(tx_doorbell, int, 0);
+
 static u32 always_on(struct net_device *dev) {
 	return 1;
 }
 
-static void (*snull_interrupt)(int, void *, struct pt_regs *);
+static void snull_regular_interrupt(int irq, void *dev_id, struct pt_regs *regs);
+static int snull_poll(struct napi_struct *napi, int budget);
+static struct rtnl_link_ops snull_link_ops;
 
+/*
+ * Counter updates only ever touch this CPU's copy. All callers run
+ * with bottom halves disabled, so they cannot nest on one CPU.
+ */
+static void snull_stats_add(struct net_device *dev, enum snull_stat stat, u64 val)
+{
+	struct snull_priv *priv = netdev_priv(dev);
+	struct snull_pcpu_stats *s = this_cpu_ptr(priv->stats);
+
+	u64_stats_update_begin(&s->syncp);
+	u64_stats_add(&s->cnt[stat], val);
+	u64_stats_update_end(&s->syncp);
+}
 
-void snull_enqueue_buf(struct net_device *dev, struct snull_packet *pkt)
+static void snull_stats_packet(struct net_device *dev, enum snull_stat packets,
+		enum snull_stat bytes, unsigned int len)
 {
-	unsigned long flags;
 	struct snull_priv *priv = netdev_priv(dev);
-	
-	spin_lock_irqsave(&priv->lock, flags);
-	pkt->next = priv->rx_queue;
-	priv->rx_queue = pkt;
-	spin_unlock_irqrestore(&priv->lock, flags);
+	struct snull_pcpu_stats *s = this_cpu_ptr(priv->stats);
+
+	u64_stats_update_begin(&s->syncp);
+	u64_stats_inc(&s->cnt[packets]);
+	u64_stats_add(&s->cnt[bytes], len);
+	u64_stats_update_end(&s->syncp);
 }
 
-struct snull_packet *snull_dequeue_buf(struct net_device *dev)
+/* count a drop both in the total and under its reason */
+static void snull_stats_drop(struct net_device *dev, enum snull_stat total,
+		enum snull_stat reason)
 {
 	struct snull_priv *priv = netdev_priv(dev);
+	struct snull_pcpu_stats *s = this_cpu_ptr(priv->stats);
+
+	u64_stats_update_begin(&s->syncp);
+	u64_stats_inc(&s->cnt[total]);
+	u64_stats_inc(&s->cnt[reason]);
+	u64_stats_update_end(&s->syncp);
+}
+
+static void snull_stats_sum(struct net_device *dev, u64 *data)
+{
+	struct snull_priv *priv = netdev_priv(dev);
+	struct snull_pcpu_stats *s;
+	u64 tmp[SNULL_STAT_NUM];
+	unsigned int start;
+	int cpu, i;
+
+	memset(data, 0, sizeof(u64) * SNULL_STAT_NUM);
+	for_each_possible_cpu(cpu) {
+		s = per_cpu_ptr(priv->stats, cpu);
+		do {
+			start = u64_stats_fetch_begin(&s->syncp);
+			for (i = 0; i < SNULL_STAT_NUM; i++)
+				tmp[i] = u64_stats_read(&s->cnt[i]);
+		} while (u64_stats_fetch_retry(&s->syncp, start));
+		for (i = 0; i < SNULL_STAT_NUM; i++)
+			data[i] += tmp[i];
+	}
+}
+
+
+static int snull_ring_init(struct snull_ring *r, unsigned int size)
+{
+	r->slots = kcalloc(size, sizeof(*r->slots), GFP_KERNEL);
+	if (r->slots == NULL)
+		return -ENOMEM;
+	r->mask = size - 1;
+	r->head = 0;
+	r->tail = 0;
+	return 0;
+}
+
+static void snull_ring_free(struct snull_ring *r)
+{
+	kfree(r->slots);
+	r->slots = NULL;
+}
+
+/* producer side */
+static bool snull_ring_full(struct snull_ring *r)
+{
+	return r->head - smp_load_acquire(&r->tail) > r->mask;
+}
+
+/* consumer side */
+static bool snull_ring_empty(struct snull_ring *r)
+{
+	return r->tail == smp_load_acquire(&r->head);
+}
+
+static unsigned int snull_ring_count(struct snull_ring *r)
+{
+	return smp_load_acquire(&r->head) - r->tail;
+}
+
+static bool snull_ring_push(struct snull_ring *r, struct snull_packet *pkt)
+{
+	unsigned int head = r->head;
+
+	if (head - smp_load_acquire(&r->tail) > r->mask)
+		return false;
+	r->slots[head & r->mask] = pkt;
+	/* publish the slot before the new head */
+	smp_store_release(&r->head, head + 1);
+	return true;
+}
+
+static struct snull_packet *snull_ring_pop(struct snull_ring *r)
+{
+	unsigned int tail = r->tail;
 	struct snull_packet *pkt;
-	unsigned long flags;
 
-	spin_lock_irqsave(&priv->lock, flags);
-	pkt = priv->rx_queue;
-	if (pkt != NULL)
-		priv->rx_queue = pkt->next;
-	spin_unlock_irqrestore(&priv->lock, flags);
+	if (tail == smp_load_acquire(&r->head))
+		return NULL;
+	pkt = r->slots[tail & r->mask];
+	/* don't let the producer reuse the slot before we have read it */
+	smp_store_release(&r->tail, tail + 1);
 	return pkt;
 }
 
-struct snull_packet *snull_get_tx_buffer(struct net_device *dev)
+bool snull_enqueue_buf(struct snull_queue *q, struct snull_packet *pkt)
+{
+	bool ok;
+
+	if (!q->shared)
+		return snull_ring_push(&q->rx_ring, pkt);
+	spin_lock(&q->rx_lock);
+	ok = snull_ring_push(&q->rx_ring, pkt);
+	spin_unlock(&q->rx_lock);
+	return ok;
+}
+
+struct snull_packet *snull_dequeue_buf(struct snull_queue *q)
+{
+	return snull_ring_pop(&q->rx_ring);
+}
+
+/* consumer side: the n-th packet, n below snull_ring_count() */
+static struct snull_packet *snull_ring_peek(struct snull_ring *r, unsigned int n)
+{
+	return r->slots[(r->tail + n) & r->mask];
+}
+
+/*
+ * Like snull_dequeue_buf, but packets still on the emulated wire stay
+ * in the ring.
+ */
+static struct snull_packet *snull_rx_next(struct snull_queue *q)
+{
+	struct snull_ring *r = &q->rx_ring;
+
+	if ((bandwidth || latency) && !snull_ring_empty(r) &&
+			ktime_after(snull_ring_peek(r, 0)->arrival, ktime_get()))
+		return NULL;
+	return snull_ring_pop(r);
+}
+
+static struct snull_packet *snull_alloc_buffer(struct snull_queue *q, gfp_t gfp)
 {
-	struct snull_priv *priv = netdev_priv(dev);
-	unsigned long flags;
 	struct snull_packet *pkt;
 
-	spin_lock_irqsave(&priv->lock, flags);
-	pkt = priv->ppool;
-	priv->ppool = pkt->next;
-	if (priv->ppool == NULL) {
-		printk(KERN_INFO MODULE_NAME ": Pool empty\n");
-		netif_stop_queue(dev);
+	pkt = kzalloc(sizeof(struct snull_packet), gfp);
+	if (pkt)
+		pkt->queue = q;
+	return pkt;
+}
+
+static u8 *snull_pkt_data(struct snull_packet *pkt)
+{
+	return page_address(pkt->page) + pkt->offset + SNULL_HEADROOM;
+}
+
+/*
+ * Drop whatever frame a descriptor still carries.
+ */
+static void snull_pkt_free_data(struct snull_packet *pkt)
+{
+	if (pkt->skb)
+		dev_kfree_skb_any(pkt->skb);
+	if (pkt->frame)
+		xdp_return_frame(pkt->frame);
+	if (pkt->page)
+		page_pool_put_page(pkt->queue->page_pool, pkt->page, -1, false);
+	pkt->skb = NULL;
+	pkt->frame = NULL;
+	pkt->page = NULL;
+}
+
+/*
+ * Give back descriptors that stayed free for a whole second: half of
+ * the smallest number of free ones seen since the last check.
+ */
+static void snull_pool_shrink(struct snull_queue *q)
+{
+	unsigned int excess = q->pool_low / 2;
+	struct snull_packet *pkt;
+
+	while (excess-- && q->nr_buffers > q->pool_min) {
+		pkt = snull_ring_pop(&q->pool);
+		if (pkt == NULL)
+			break;
+		kfree(pkt);
+		q->nr_buffers--;
+		snull_stats_add(q->dev, SNULL_STAT_POOL_SHRINK, 1);
+	}
+	q->pool_low = UINT_MAX;
+	q->pool_next_shrink = jiffies + HZ;
+}
+
+struct snull_packet *snull_get_tx_buffer(struct snull_queue *q)
+{
+	struct snull_packet *pkt;
+	unsigned int avail;
+
+	pkt = snull_ring_pop(&q->pool);
+	if (pkt == NULL) {
+		/* empty, but there is room in the ring: grow instead of stopping */
+		snull_stats_add(q->dev, SNULL_STAT_POOL_EMPTY, 1);
+		if (q->nr_buffers > q->pool.mask)
+			return NULL;
+		pkt = snull_alloc_buffer(q, GFP_ATOMIC);
+		if (pkt) {
+			q->nr_buffers++;
+			snull_stats_add(q->dev, SNULL_STAT_POOL_GROW, 1);
+		}
+		return pkt;
+	}
+
+	avail = snull_ring_count(&q->pool);
+	q->pool_low = min(q->pool_low, avail);
+	if (avail == 0 && q->nr_buffers > q->pool.mask) {
+		/* every buffer the ring can hold is in flight */
+		snull_stats_add(q->dev, SNULL_STAT_QUEUE_STOPPED, 1);
+		netif_stop_subqueue(q->dev, q->index);
+		set_bit(SNULL_POOL_STOPPED, &q->state);
+		smp_mb__after_atomic();
+		/* a buffer may have come back before the flag was visible */
+		if (!snull_ring_empty(&q->pool) &&
+				test_and_clear_bit(SNULL_POOL_STOPPED, &q->state))
+			netif_start_subqueue(q->dev, q->index);
+	} else if (time_after(jiffies, q->pool_next_shrink)) {
+		snull_pool_shrink(q);
 	}
-	spin_unlock_irqrestore(&priv->lock, flags);
 	return pkt;
 }
 
 void snull_release_buffer(struct snull_packet *pkt)
 {
-	unsigned long flags;
-	struct snull_priv *priv = netdev_priv(pkt->dev);
-	
-	spin_lock_irqsave(&priv->lock, flags);
-	pkt->next = priv->ppool;
-	priv->ppool = pkt;
-	spin_unlock_irqrestore(&priv->lock, flags);
-	if (netif_queue_stopped(pkt->dev) && pkt->next == NULL)
-		netif_wake_queue(pkt->dev);
+	struct snull_queue *q = pkt->queue;
+
+	/* can't fail: the pool ring is sized to hold every buffer */
+	if (q->shared) {
+		spin_lock(&q->pool_lock);
+		snull_ring_push(&q->pool, pkt);
+		spin_unlock(&q->pool_lock);
+	} else {
+		snull_ring_push(&q->pool, pkt);
+	}
+	smp_mb__before_atomic();
+	if (test_and_clear_bit(SNULL_POOL_STOPPED, &q->state))
+		netif_wake_subqueue(q->dev, q->index);
 }
 
 /*
  * Enable and disable receive interrupts.
  */
-static void snull_rx_ints(struct net_device *dev, int enable)
+static void snull_rx_ints(struct snull_queue *q, int enable)
+{
+	q->rx_int_enabled = enable;
+}
+
+/* Arm the RX timer, unless it already fires earlier. Queue lock held. */
+static void snull_rx_timer_arm(struct snull_queue *q, ktime_t when)
+{
+	if (!hrtimer_is_queued(&q->rx_timer) ||
+			ktime_before(when, hrtimer_get_expires(&q->rx_timer)))
+		hrtimer_start(&q->rx_timer, when, HRTIMER_MODE_ABS_SOFT);
+}
+
+/*
+ * Interrupt moderation: the RX interrupt fires rx_usecs after the
+ * first packet arrives, or as soon as rx_frames packets have arrived,
+ * whichever comes first. Called with the queue lock held for a packet
+ * just put in the ring; returns true if the interrupt is due now,
+ * otherwise the timer raises it later.
+ */
+static bool snull_rx_moderate(struct snull_queue *q, ktime_t arrival)
+{
+	struct snull_priv *priv = netdev_priv(q->dev);
+	u32 frames = READ_ONCE(priv->rx_frames);
+	ktime_t when;
+
+	if (q->coal_frames++ == 0)
+		q->coal_first = arrival;
+	when = ktime_add_us(q->coal_first, READ_ONCE(priv->rx_usecs));
+	if (frames && q->coal_frames >= frames && ktime_before(arrival, when))
+		when = arrival;
+	if (ktime_after(when, ktime_get())) {
+		snull_rx_timer_arm(q, when);
+		return false;
+	}
+	q->coal_frames = 0;
+	return true;
+}
+
+/*
+ * Same thing for whatever is left in the ring once the RX handling is
+ * done: packets still on the wire, or queued while interrupts were off.
+ * Queue lock held.
+ */
+static bool snull_rx_rearm(struct snull_queue *q)
+{
+	struct snull_priv *priv = netdev_priv(q->dev);
+	unsigned int n = snull_ring_count(&q->rx_ring);
+	u32 frames = READ_ONCE(priv->rx_frames);
+	ktime_t when, nth;
+
+	q->coal_frames = n;
+	if (n == 0)
+		return false;
+	q->coal_first = snull_ring_peek(&q->rx_ring, 0)->arrival;
+	when = ktime_add_us(q->coal_first, READ_ONCE(priv->rx_usecs));
+	if (frames && n >= frames) {
+		nth = snull_ring_peek(&q->rx_ring, frames - 1)->arrival;
+		if (ktime_before(nth, when))
+			when = nth;
+	}
+	if (ktime_after(when, ktime_get())) {
+		snull_rx_timer_arm(q, when);
+		return false;
+	}
+	q->coal_frames = 0;
+	return true;
+}
+
+/*
+ * Raise the interrupt of @q. Every queue has a line of its own, an
+ * irq_work routed to the queue's CPU: the sender only posts it and goes
+ * on, the handler runs over there, like an MSI-X vector would.
+ */
+static void snull_raise_irq(struct snull_queue *q)
+{
+	int cpu = q->cpu;
+
+	if (!cpu_online(cpu))
+		cpu = raw_smp_processor_id();
+	irq_work_queue_on(&q->irq, cpu);
+}
+
+/*
+ * The hard interrupt handler: just schedule the real work, the NAPI
+ * poll or (regular mode) the queue's tasklet, on this same CPU.
+ */
+static void snull_irq(struct irq_work *work)
+{
+	struct snull_queue *q = container_of(work, struct snull_queue, irq);
+
+	if (use_napi)
+		napi_schedule(&q->napi);
+	else
+		tasklet_schedule(&q->bh);
+}
+
+static void snull_irq_bh(struct tasklet_struct *t)
+{
+	struct snull_queue *q = from_tasklet(q, t, bh);
+
+	snull_regular_interrupt(0, q, NULL);
+}
+
+/*
+ * Latch an RX interrupt, queue lock held. In NAPI mode the line masks
+ * itself until the poll is over and turns it back on.
+ */
+static void snull_rx_latch(struct snull_queue *q)
+{
+	q->status |= SNULL_RX_INTR;
+	if (use_napi)
+		snull_rx_ints(q, 0);
+}
+
+/*
+ * A packet for @q went on the wire: raise its RX interrupt, now or
+ * when moderation allows.
+ */
+static void snull_rx_signal(struct snull_queue *q, ktime_t arrival)
+{
+	bool fire = false;
+
+	spin_lock(&q->lock);
+	if (q->rx_int_enabled && snull_rx_moderate(q, arrival)) {
+		snull_rx_latch(q);
+		fire = true;
+	}
+	spin_unlock(&q->lock);
+	if (fire)
+		snull_raise_irq(q);
+}
+
+static enum hrtimer_restart snull_rx_timer(struct hrtimer *timer)
+{
+	struct snull_queue *q = container_of(timer, struct snull_queue, rx_timer);
+	bool fire = false;
+
+	spin_lock(&q->lock);
+	q->coal_frames = 0;
+	/* masked meanwhile: the poll, or snull_stop, takes it from here */
+	if (q->rx_int_enabled) {
+		snull_rx_latch(q);
+		fire = true;
+	}
+	spin_unlock(&q->lock);
+	if (fire)
+		snull_raise_irq(q);
+	return HRTIMER_NORESTART;
+}
+
+/*
+ * When a frame of @len octets put on the wire at @now reaches the peer:
+ * it waits for the frames ahead of it to be serialized at the emulated
+ * bandwidth, then travels for latency microseconds. Both directions
+ * have a wire of their own, shared by all the queues.
+ */
+static ktime_t snull_link_arrival(struct net_device *dev, unsigned int len,
+		ktime_t now)
 {
 	struct snull_priv *priv = netdev_priv(dev);
-	priv->rx_int_enabled = enable;
+	s64 busy, done;
+	u64 ns;
+
+	if (!bandwidth && !latency)
+		return now;
+	done = now;
+	if (bandwidth) {
+		/* Mbit/s is bits per microsecond */
+		ns = div_u64((u64)(len + SNULL_WIRE_OVERHEAD) * 8 * NSEC_PER_USEC,
+				bandwidth);
+		do {
+			busy = atomic64_read(&priv->link_busy);
+			done = max(busy, now) + ns;
+		} while (atomic64_cmpxchg(&priv->link_busy, busy, done) != busy);
+	}
+	return ktime_add_us(done, latency);
+}
+
+/*
+ * RSS-style flow spreading: every packet of a flow hashes to the same
+ * TX queue, and TX queue i delivers to the peer's RX queue i.
+ */
+static u16 snull_flow_queue(struct net_device *dev, u32 hash)
+{
+	struct snull_priv *priv = netdev_priv(dev);
+
+	return reciprocal_scale(hash, priv->num_queues);
+}
+
+/*
+ * The other end of the wire, NULL on a switch port or once the pair
+ * is being torn down.
+ */
+static struct net_device *snull_peer(struct net_device *dev)
+{
+	struct snull_priv *priv = netdev_priv(dev);
+
+	return rcu_dereference_rtnl(priv->peer);
+}
+
+/* the RX queue of @dev that our TX queue @q feeds */
+static struct snull_queue *snull_port_queue(struct net_device *dev,
+		struct snull_queue *q)
+{
+	struct snull_priv *priv = netdev_priv(dev);
+
+	return &priv->queues[q->index];
+}
+
+static u32 snull_fdb_hash(const u8 *addr)
+{
+	return hash_64(ether_addr_to_u64(addr), SNULL_FDB_BITS);
+}
+
+static struct snull_fdb *snull_fdb_find(struct snull_switch *sw, const u8 *addr)
+{
+	struct snull_fdb *f;
+
+	hlist_for_each_entry_rcu(f, &sw->fdb[snull_fdb_hash(addr)], hlist) {
+		if (ether_addr_equal(f->addr, addr))
+			return f;
+	}
+	return NULL;
+}
+
+static struct net_device *snull_fdb_lookup(struct snull_switch *sw, const u8 *addr)
+{
+	struct snull_fdb *f = snull_fdb_find(sw, addr);
+
+	if (f == NULL || time_after(jiffies, READ_ONCE(f->used) + SNULL_FDB_AGE))
+		return NULL;
+	return READ_ONCE(f->port);
+}
+
+/*
+ * Remember that @addr sits behind @port. The common case, a known
+ * station talking again, only touches its entry.
+ */
+static void snull_fdb_learn(struct snull_switch *sw, const u8 *addr,
+		struct net_device *port)
+{
+	struct snull_fdb *f;
+
+	if (!is_valid_ether_addr(addr))
+		return;
+	f = snull_fdb_find(sw, addr);
+	if (f) {
+		if (READ_ONCE(f->port) != port)
+			WRITE_ONCE(f->port, port); /* the station moved */
+		if (READ_ONCE(f->used) != jiffies)
+			WRITE_ONCE(f->used, jiffies);
+		return;
+	}
+
+	spin_lock(&sw->lock);
+	if (snull_fdb_find(sw, addr) == NULL && sw->fdb_count < SNULL_FDB_MAX) {
+		f = kzalloc(sizeof(*f), GFP_ATOMIC);
+		if (f) {
+			ether_addr_copy(f->addr, addr);
+			f->port = port;
+			f->used = jiffies;
+			hlist_add_head_rcu(&f->hlist, &sw->fdb[snull_fdb_hash(addr)]);
+			sw->fdb_count++;
+		}
+	}
+	spin_unlock(&sw->lock);
+}
+
+static void snull_switch_put(struct snull_switch *sw)
+{
+	struct snull_fdb *f;
+	struct hlist_node *tmp;
+	int bkt;
+
+	if (!refcount_dec_and_test(&sw->refs))
+		return;
+	hash_for_each_safe(sw->fdb, bkt, tmp, f, hlist) {
+		hash_del_rcu(&f->hlist);
+		kfree_rcu(f, rcu);
+	}
+	kfree(sw);
+}
+
+/*
+ * snull's "network": flip the third octet of both IP addresses.
+ * The checksums are patched incrementally (RFC 1624) instead of being
+ * recomputed: the IP header's, and the TCP or UDP one, whose
+ * pseudo-header covers the addresses. @l4 is NULL when there is no
+ * TCP/UDP header to fix (other protocols, later fragments). @skb is
+ * NULL for an XDP frame, whose checksums are always complete.
+ */
+static void snull_rewrite_ip(struct iphdr *ih, void *l4, struct sk_buff *skb)
+{
+	__be32 *addr[2] = { &ih->saddr, &ih->daddr };
+	bool partial = skb && skb->ip_summed == CHECKSUM_PARTIAL;
+	__sum16 *check = NULL;
+	__be32 old;
+	int i;
+
+	if (l4 && ih->protocol == IPPROTO_TCP)
+		check = &((struct tcphdr *)l4)->check;
+	else if (l4 && ih->protocol == IPPROTO_UDP)
+		check = &((struct udphdr *)l4)->check;
+	/* a zero UDP checksum means none, unless we are to fill it in */
+	if (check && ih->protocol == IPPROTO_UDP && !*check && !partial)
+		check = NULL;
+
+	for (i = 0; i < 2; i++) {
+		old = *addr[i];
+		((u8 *)addr[i])[2] ^= 1; /* change the third octet */
+		csum_replace4(&ih->check, old, *addr[i]);
+		if (check && skb)
+			inet_proto_csum_replace4(check, skb, old, *addr[i], true);
+		else if (check)
+			csum_replace4(check, old, *addr[i]);
+	}
+	if (check && ih->protocol == IPPROTO_UDP && !*check && !partial)
+		*check = CSUM_MANGLED_0;
+}
+
+/* size of the TCP/UDP header we have to patch, 0 if none */
+static unsigned int snull_l4_len(const struct iphdr *ih)
+{
+	if (ih->frag_off & htons(IP_OFFSET))
+		return 0;
+	switch (ih->protocol) {
+	case IPPROTO_TCP:
+		return sizeof(struct tcphdr);
+	case IPPROTO_UDP:
+		return sizeof(struct udphdr);
+	default:
+		return 0;
+	}
+}
+
+/*
+ * Rewrite an skb about to go on the wire. Anything but IPv4 passes
+ * untouched. Returns false if the headers could not be pulled in.
+ */
+static bool snull_rewrite(struct sk_buff *skb)
+{
+	unsigned int l3 = sizeof(struct ethhdr), l4len;
+	struct iphdr *ih;
+
+	if (((struct ethhdr *)skb->data)->h_proto != htons(ETH_P_IP))
+		return true;
+	if (!pskb_may_pull(skb, l3 + sizeof(struct iphdr)))
+		return false;
+	ih = (struct iphdr *)(skb->data + l3);
+	if (ih->version != 4 || ih->ihl < 5)
+		return true;
+	l4len = snull_l4_len(ih);
+	if (!pskb_may_pull(skb, l3 + ih->ihl * 4 + l4len))
+		return false;
+	ih = (struct iphdr *)(skb->data + l3); /* the head may have moved */
+	snull_rewrite_ip(ih, l4len ? (u8 *)ih + ih->ihl * 4 : NULL, skb);
+	return true;
+}
+
+static void snull_rewrite_frame(struct xdp_frame *frame)
+{
+	unsigned int l3 = sizeof(struct ethhdr), l4len;
+	struct iphdr *ih = frame->data + l3;
+
+	if (((struct ethhdr *)frame->data)->h_proto != htons(ETH_P_IP) ||
+			ih->version != 4 || ih->ihl < 5)
+		return;
+	l4len = snull_l4_len(ih);
+	if (l3 + ih->ihl * 4 + l4len > frame->len)
+		return;
+	snull_rewrite_ip(ih, l4len ? (u8 *)ih + ih->ihl * 4 : NULL, NULL);
+}
+
+/*
+ * Copy a frame out of @skb the way a NIC with NETIF_F_HW_CSUM does: a
+ * checksum the stack left to us (CHECKSUM_PARTIAL) is summed while
+ * its bytes are copied and stored in the copy, as skb_checksum_help()
+ * would have.
+ */
+static void snull_copy_frame(struct sk_buff *skb, u8 *to)
+{
+	int start, len = skb->len;
+	__wsum csum;
+
+	if (skb->ip_summed != CHECKSUM_PARTIAL) {
+		skb_copy_bits(skb, 0, to, len);
+		return;
+	}
+	start = skb_checksum_start_offset(skb);
+	skb_copy_bits(skb, 0, to, start);
+	csum = skb_copy_and_csum_bits(skb, start, to + start, len - start);
+	*(__sum16 *)(to + start + skb->csum_offset) = csum_fold(csum) ?: CSUM_MANGLED_0;
+}
+
+/*
+ * What the "hardware" reports on receive. Every checksum is complete
+ * and right once on the wire (see snull_copy_frame and snull_rewrite)
+ * and memory does not flip bits, so with RX checksumming on the stack
+ * may skip verifying them, as with veth. A handed-over skb may still
+ * be CHECKSUM_PARTIAL: that is valid on receive, and a forwarded GSO
+ * skb needs it to be segmented again.
+ */
+static void snull_rx_csum(struct net_device *dev, struct sk_buff *skb)
+{
+	if (skb->ip_summed == CHECKSUM_PARTIAL)
+		return;
+	if (dev->features & NETIF_F_RXCSUM)
+		skb->ip_summed = CHECKSUM_UNNECESSARY;
+	else
+		skb->ip_summed = CHECKSUM_NONE;
+}
+
+/*
+ * Does this skb travel to the peer by reference rather than by copy?
+ */
+static bool snull_handoff(struct sk_buff *skb)
+{
+	return zerocopy || skb->len > SNULL_BUF_LEN;
+}
+
+/*
+ * Put one frame on the wire to the RX queue @dq. Like a scatter-gather
+ * DMA engine, it reads the linear headers and the page fragments of the
+ * skb directly. Returns false if the frame was dropped; the skb is left
+ * to the caller then. On success a handed-off skb belongs to the
+ * receiver, a copied one is untouched.
+ */
+static bool snull_wire_tx(struct snull_queue *q, struct snull_queue *dq,
+		struct sk_buff *skb)
+{
+	int len = skb->len;
+	struct net_device *dev = q->dev;
+	struct snull_packet *tx_buffer;
+	struct page *page = NULL;
+	unsigned int offset = 0, truesize = 0;
+	ktime_t arrival;
+
+	if (!netif_running(dq->dev)) {
+		snull_stats_drop(dev, SNULL_STAT_TX_DROPPED, SNULL_STAT_TX_DROP_PEER_DOWN);
+		return false;
+	}
+	/* only a hint on a switch port, snull_enqueue_buf has the last word */
+	if (snull_ring_full(&dq->rx_ring)) {
+		snull_stats_drop(dev, SNULL_STAT_TX_DROPPED, SNULL_STAT_TX_DROP_RING_FULL);
+		return false;
+	}
+
+	if (!snull_handoff(skb)) {
+		/* copy into a right-sized fragment the peer can build_skb() on */
+		truesize = SNULL_TRUESIZE(len);
+		page = page_pool_dev_alloc_frag(q->page_pool, &offset, truesize);
+		if (page == NULL) {
+			snull_stats_drop(dev, SNULL_STAT_TX_DROPPED, SNULL_STAT_TX_DROP_NOMEM);
+			return false;
+		}
+	}
+
+	tx_buffer = snull_get_tx_buffer(q);
+	if (tx_buffer == NULL) {
+		snull_stats_drop(dev, SNULL_STAT_TX_DROPPED, SNULL_STAT_TX_DROP_NO_BUFFER);
+		if (page)
+			page_pool_put_page(q->page_pool, page, -1, true);
+		return false;
+	}
+	tx_buffer->datalen = len;
+	tx_buffer->stamp = ktime_get();
+	tx_buffer->arrival = arrival = snull_link_arrival(dev, len, tx_buffer->stamp);
+	if (page) {
+		tx_buffer->page = page;
+		tx_buffer->offset = offset;
+		tx_buffer->truesize = truesize;
+		snull_copy_frame(skb, snull_pkt_data(tx_buffer));
+	} else {
+		/* the peer owns the skb, fragments and all, from now on */
+		tx_buffer->skb = skb;
+	}
+	if (!snull_enqueue_buf(dq, tx_buffer)) {
+		/* another switch port took the last slot */
+		snull_stats_drop(dev, SNULL_STAT_TX_DROPPED, SNULL_STAT_TX_DROP_RING_FULL);
+		tx_buffer->skb = NULL;
+		snull_pkt_free_data(tx_buffer);
+		snull_release_buffer(tx_buffer);
+		return false;
+	}
+	trace_snull_enqueue(dq->dev, dq->index, len,
+			ktime_to_ns(ktime_sub(arrival, tx_buffer->stamp)));
+	/* the peer may already be done with tx_buffer */
+	snull_rx_signal(dq, arrival);
+	return true;
+}
+
+/*
+ * Switch mode: learn where the sender lives and forward to the port
+ * that owns the destination, or flood to every other port. Copies go
+ * out of the same skb; in handoff mode all ports but the last get a
+ * clone. Same return convention as snull_hw_tx.
+ */
+static bool snull_switch_tx(struct snull_queue *q, struct sk_buff *skb)
+{
+	struct net_device *dev = q->dev;
+	struct snull_switch *sw = ((struct snull_priv *)netdev_priv(dev))->sw;
+	struct ethhdr *eth = (struct ethhdr *)skb->data;
+	struct net_device *dest = NULL, *port, *last = NULL;
+	bool handoff = snull_handoff(skb), sent = false;
+	unsigned int len = skb->len;
+	struct sk_buff *clone;
+	int i;
+
+	snull_fdb_learn(sw, eth->h_source, dev);
+	if (is_unicast_ether_addr(eth->h_dest))
+		dest = snull_fdb_lookup(sw, eth->h_dest);
+	if (dest == dev) {
+		/* no hairpin forwarding */
+		snull_stats_drop(dev, SNULL_STAT_TX_DROPPED, SNULL_STAT_TX_DROP_HAIRPIN);
+		dev_kfree_skb(skb);
+		return false;
+	}
+
+	if (dest == NULL) {
+		for (i = 0; i < sw->nr_ports; i++) {
+			port = sw->ports[i];
+			if (port == dev || !netif_running(port))
+				continue;
+			if (last) {
+				clone = handoff ? skb_clone(skb, GFP_ATOMIC) : skb;
+				if (clone == NULL)
+					snull_stats_drop(dev, SNULL_STAT_TX_DROPPED,
+							SNULL_STAT_TX_DROP_NOMEM);
+				else if (snull_wire_tx(q, snull_port_queue(last, q), clone))
+					sent = true;
+				else if (handoff)
+					dev_kfree_skb(clone);
+			}
+			last = port;
+		}
+		dest = last;
+	}
+
+	if (dest && snull_wire_tx(q, snull_port_queue(dest, q), skb))
+		sent = true;
+	else if (handoff || !sent)
+		dev_kfree_skb(skb);
+	if (sent)
+		snull_stats_packet(dev, SNULL_STAT_TX_PACKETS, SNULL_STAT_TX_BYTES, len);
+	return sent && !handoff;
 }
 
-static void snull_hw_tx(char *buf, int len, struct net_device *dev)
+/*
+ * Put one skb on the wire. Returns false if it was dropped (and freed)
+ * or handed over; true means the skb is still ours until the TX
+ * completion.
+ */
+static bool snull_hw_tx(struct snull_queue *q, struct sk_buff *skb)
 {
 	/*
 	 * this function implements snull's mechanism.
-	 *
 	 * */
-	struct iphdr *ih;
+	int len = skb->len;
+	struct net_device *dev = q->dev;
 	struct net_device *dest;
-	struct snull_priv *priv;
-	u32 *saddr;
-	u32 *daddr;
+	bool handoff = snull_handoff(skb);
+
+	if (((struct snull_priv *)netdev_priv(dev))->sw)
+		return snull_switch_tx(q, skb);
+
+	if (!snull_rewrite(skb)) {
+		snull_stats_drop(dev, SNULL_STAT_TX_DROPPED, SNULL_STAT_TX_DROP_NOMEM);
+		dev_kfree_skb(skb);
+		return false;
+	}
+
+	/*
+	 * The flow was steered when the stack picked our TX queue (see
+	 * snull_select_queue), the peer's RX queue with the same index
+	 * receives it.
+	 */
+	dest = snull_peer(dev);
+	if (dest == NULL) {
+		snull_stats_drop(dev, SNULL_STAT_TX_DROPPED, SNULL_STAT_TX_DROP_PEER_DOWN);
+		dev_kfree_skb(skb);
+		return false;
+	}
+	if (!snull_wire_tx(q, snull_port_queue(dest, q), skb)) {
+		dev_kfree_skb(skb);
+		return false;
+	}
+	snull_stats_packet(dev, SNULL_STAT_TX_PACKETS, SNULL_STAT_TX_BYTES, len);
+	return !handoff;
+}
+
+/*
+ * Ring the doorbell: put everything snull_tx queued on the wire, then
+ * raise a single TX interrupt for the whole batch. Called with the TX
+ * queue lock held.
+ */
+static void snull_tx_flush(struct snull_queue *q)
+{
+	struct net_device *dev = q->dev;
+	struct sk_buff_head done;
+	struct sk_buff *skb;
+	unsigned int pkts = 0, bytes = 0;
+	bool locked_up = false;
+
+	__skb_queue_head_init(&done);
+	while ((skb = __skb_dequeue(&q->tx_pending)) != NULL) {
+		/* BQL saw every queued skb, it has to see all of them complete */
+		pkts++;
+		bytes += skb->len;
+		if (snull_hw_tx(q, skb))
+			__skb_queue_tail(&done, skb);
+		if (lockup && (++q->tx_seq % lockup) == 0)
+			locked_up = true;
+	}
+	if (!pkts)
+		return;
+
+	spin_lock(&q->lock);
+	skb_queue_splice_tail_init(&done, &q->tx_done);
+	q->tx_done_pkts += pkts;
+	q->tx_done_bytes += bytes;
+	q->status |= SNULL_TX_INTR;
+	spin_unlock(&q->lock);
+
+	if (locked_up) {
+		/* simulate a dropped transmit interrupt */
+		snull_stats_add(dev, SNULL_STAT_LOCKUP, 1);
+		snull_stats_add(dev, SNULL_STAT_QUEUE_STOPPED, 1);
+		netif_stop_subqueue(dev, q->index);
+		printk(KERN_INFO MODULE_NAME ": Simulate lockup at %ld, queue %d txp %lu\n", 
+				jiffies, q->index, q->tx_seq);
+	} else {
+		snull_raise_irq(q);
+	}
+}
+
+/*
+ * Clean up after every batch that is over: tell BQL and free the copied
+ * skbs, all at once and outside the queue lock. Runs in the interrupt
+ * handling of the queue, on its CPU; @budget is the NAPI one, 0 outside
+ * a poll.
+ */
+static void snull_tx_complete(struct snull_queue *q, int budget)
+{
+	struct sk_buff_head done;
+	struct sk_buff *skb;
+	unsigned int pkts, bytes;
+
+	__skb_queue_head_init(&done);
+	spin_lock(&q->lock);
+	q->status &= ~SNULL_TX_INTR;
+	skb_queue_splice_init(&q->tx_done, &done);
+	pkts = q->tx_done_pkts;
+	bytes = q->tx_done_bytes;
+	q->tx_done_pkts = 0;
+	q->tx_done_bytes = 0;
+	spin_unlock(&q->lock);
+	if (!pkts)
+		return;
+
+	trace_snull_tx_complete(q->dev, q->index, pkts, bytes);
+	netdev_tx_completed_queue(netdev_get_tx_queue(q->dev, q->index), pkts, bytes);
+	while ((skb = __skb_dequeue(&done)) != NULL)
+		napi_consume_skb(skb, budget);
+}
+
+
+/*
+ * Put an XDP frame on the wire: no skb, no copy, the peer gets the
+ * frame itself. Called with the TX queue lock held, which keeps our
+ * pool and the peer's RX ring single-producer.
+ */
+static int snull_hw_xmit_frame(struct snull_queue *q, struct xdp_frame *frame)
+{
+	struct net_device *dev = q->dev;
+	struct net_device *dest = snull_peer(dev);
+	struct snull_queue *dq;
 	struct snull_packet *tx_buffer;
+	ktime_t arrival;
+
+	if (frame->len < sizeof(struct ethhdr) + sizeof(struct iphdr))
+		return -EINVAL;
+	if (dest == NULL || !netif_running(dest)) {
+		snull_stats_drop(dev, SNULL_STAT_TX_DROPPED, SNULL_STAT_TX_DROP_PEER_DOWN);
+		return -ENETDOWN;
+	}
+	dq = snull_port_queue(dest, q);
+	if (snull_ring_full(&dq->rx_ring)) {
+		snull_stats_drop(dev, SNULL_STAT_TX_DROPPED, SNULL_STAT_TX_DROP_RING_FULL);
+		return -ENOSPC;
+	}
+	tx_buffer = snull_get_tx_buffer(q);
+	if (tx_buffer == NULL) {
+		snull_stats_drop(dev, SNULL_STAT_TX_DROPPED, SNULL_STAT_TX_DROP_NO_BUFFER);
+		return -ENOBUFS;
+	}
+
+	snull_rewrite_frame(frame);
+	tx_buffer->datalen = frame->len;
+	tx_buffer->frame = frame;
+	tx_buffer->stamp = ktime_get();
+	tx_buffer->arrival = arrival = snull_link_arrival(dev, frame->len, tx_buffer->stamp);
+	snull_stats_packet(dev, SNULL_STAT_TX_PACKETS, SNULL_STAT_TX_BYTES, frame->len);
+	snull_stats_add(dev, SNULL_STAT_XDP_XMIT, 1);
+	trace_snull_enqueue(dq->dev, dq->index, frame->len,
+			ktime_to_ns(ktime_sub(arrival, tx_buffer->stamp)));
+	snull_enqueue_buf(dq, tx_buffer);
+	snull_rx_signal(dq, arrival);
+	return 0;
+}
+
+/*
+ * ndo_xdp_xmit: frames redirected to us (or bounced with XDP_TX) go
+ * straight into the peer's RX ring. Returns how many were sent, the
+ * caller frees the rest.
+ */
+static int snull_xdp_xmit(struct net_device *dev, int n,
+		struct xdp_frame **frames, u32 flags)
+{
+	struct snull_priv *priv = netdev_priv(dev);
+	int cpu = smp_processor_id();
+	struct snull_queue *q;
+	struct netdev_queue *txq;
+	int i;
+
+	if (unlikely(flags & ~XDP_XMIT_FLAGS_MASK))
+		return -EINVAL;
+	if (!netif_running(dev) || READ_ONCE(priv->resizing))
+		return -ENETDOWN;
+
+	/* any CPU may redirect to us, share the queues like XDP_TX does */
+	q = &priv->queues[cpu % priv->num_queues];
+	txq = netdev_get_tx_queue(dev, q->index);
+	__netif_tx_lock(txq, cpu);
+	for (i = 0; i < n; i++) {
+		if (snull_hw_xmit_frame(q, frames[i]))
+			break;
+	}
+	__netif_tx_unlock(txq);
+	return i;
+}
+
+static unsigned int snull_ring_size(unsigned int n)
+{
+	return roundup_pow_of_two(clamp_t(unsigned int, n, 2, SNULL_MAX_RING));
+}
+
+static unsigned int snull_pool_fill(unsigned int size)
+{
+	return clamp_t(unsigned int, pool_size, 1, size);
+}
 
-	if (len < sizeof(struct ethhdr) + sizeof(struct iphdr)) {
-		printk(KERN_ALERT MODULE_NAME ": snull: packet too short (%i octets)\n",
-				len);
+void snull_teardown_pool(struct snull_ring *pool)
+{
+	struct snull_packet *pkt;
+
+	if (pool->slots == NULL)
 		return;
+	while ((pkt = snull_ring_pop(pool)))
+		kfree(pkt);
+	snull_ring_free(pool);
+}
+
+/*
+ * Create a pool ring of the given size holding pool_size descriptors
+ * to start with; the rest are allocated as traffic demands.
+ */
+int snull_setup_pool(struct snull_queue *q, struct snull_ring *pool, unsigned int size)
+{
+	int i;
+	struct snull_packet *pkt;
+
+	if (snull_ring_init(pool, size))
+		return -ENOMEM;
+	for (i = 0; i < snull_pool_fill(size); i++) {
+		pkt = snull_alloc_buffer(q, GFP_KERNEL);
+		if (pkt == NULL) {
+			printk(KERN_NOTICE MODULE_NAME ": Ran out of memory allocating pkt pool\n");
+			snull_teardown_pool(pool);
+			return -ENOMEM;
+		}
+		snull_ring_push(pool, pkt);
 	}
+	return 0;
+}
 
-	ih = (struct iphdr *)(buf+sizeof(struct ethhdr));
-	saddr = &ih->saddr;
-	daddr = &ih->daddr;
+/* reset the sizing policy after (re)filling the pool */
+static void snull_pool_reset(struct snull_queue *q)
+{
+	q->nr_buffers = snull_pool_fill(q->pool.mask + 1);
+	q->pool_min = q->nr_buffers;
+	q->pool_low = UINT_MAX;
+	q->pool_next_shrink = jiffies + HZ;
+}
 
-	((u8 *)saddr)[2] ^= 1; /* change the third octet */
-	((u8 *)daddr)[2] ^= 1;
 
-	ih->check = 0; /* and rebuild the checksum (ip needs it)  */
-	ih->check = ip_fast_csum((unsigned char *)ih, ih->ihl);
-	printk(KERN_INFO MODULE_NAME ": ih->check = %d\n", ih->check);
+static int snull_num_queues(void)
+{
+	int n = num_queues > 0 ? num_queues : num_online_cpus();
 
-	if (dev == snull_devs[0]) {
-		printk(KERN_INFO MODULE_NAME ": %08x:%5i --> %08x:%05i\n",
-				ntohl(ih->saddr), ntohs(((struct tcphdr *)(ih+1))->source),
-				ntohl(ih->daddr), ntohs(((struct tcphdr *)(ih+1))->dest)
-			   );
-	} else {
-		printk(KERN_INFO MODULE_NAME ": %08x:%5i --> %08x:%05i\n",
-				ntohl(ih->saddr), ntohs(((struct tcphdr *)(ih+1))->source),
-				ntohl(ih->daddr), ntohs(((struct tcphdr *)(ih+1))->dest)
-			   );
+	return min(n, SNULL_MAX_QUEUES);
+}
+
+static int snull_queue_init(struct net_device *dev, struct snull_queue *q, int index)
+{
+	struct snull_priv *priv = netdev_priv(dev);
+	struct page_pool_params pp_params = {
+		.order = 0,
+		.pool_size = priv->tx_ring_size,
+		.nid = dev_to_node(&dev->dev),
+	};
+	int err;
+
+	q->dev = dev;
+	q->index = index;
+	q->shared = priv->sw != NULL;
+	spin_lock_init(&q->rx_lock);
+	spin_lock_init(&q->pool_lock);
+	spin_lock_init(&q->lock);
+	__skb_queue_head_init(&q->tx_pending);
+	__skb_queue_head_init(&q->tx_done);
+	hrtimer_init(&q->rx_timer, CLOCK_MONOTONIC, HRTIMER_MODE_ABS_SOFT);
+	q->rx_timer.function = snull_rx_timer;
+	q->cpu = cpumask_local_spread(index, dev_to_node(&dev->dev));
+	init_irq_work(&q->irq, snull_irq);
+	tasklet_setup(&q->bh, snull_irq_bh);
+	snull_rx_ints(q, 1);
+	if (use_napi)
+		netif_napi_add(dev, &q->napi, snull_poll);
+
+	err = xdp_rxq_info_reg(&q->xdp_rxq, dev, index, use_napi ? q->napi.napi_id : 0);
+	if (err)
+		goto err_napi;
+	err = xdp_rxq_info_reg_mem_model(&q->xdp_rxq, MEM_TYPE_PAGE_SHARED, NULL);
+	if (err)
+		goto err_rxq;
+
+	/*
+	 * Frame buffers. Pages are taken under our TX queue lock and come
+	 * back through the pool's ring from wherever the peer frees them.
+	 */
+	q->page_pool = page_pool_create(&pp_params);
+	if (IS_ERR(q->page_pool)) {
+		err = PTR_ERR(q->page_pool);
+		q->page_pool = NULL;
+		goto err_rxq;
 	}
 
-	dest = snull_devs[dev == snull_devs[0] ? 1 : 0];
-	priv = netdev_priv(dest);
-	tx_buffer = snull_get_tx_buffer(dev);
-	tx_buffer->datalen = len;
-	memcpy(tx_buffer->data, buf, len);
-	snull_enqueue_buf(dest, tx_buffer);
+	err = snull_setup_pool(q, &q->pool, priv->tx_ring_size);
+	if (err)
+		goto err_page_pool;
+	snull_pool_reset(q);
+	err = snull_ring_init(&q->rx_ring, priv->rx_ring_size);
+	if (err)
+		goto err_pool;
+	return 0;
+
+err_pool:
+	snull_teardown_pool(&q->pool);
+err_page_pool:
+	page_pool_destroy(q->page_pool);
+err_rxq:
+	xdp_rxq_info_unreg(&q->xdp_rxq);
+err_napi:
+	if (use_napi)
+		netif_napi_del(&q->napi);
+	return err;
+}
+
+static void snull_queue_teardown(struct snull_queue *q)
+{
+	hrtimer_cancel(&q->rx_timer);
+	irq_work_sync(&q->irq);
+	tasklet_kill(&q->bh);
+	snull_ring_free(&q->rx_ring);
+	snull_teardown_pool(&q->pool);
+	page_pool_destroy(q->page_pool);
+	if (q->xdp_page)
+		put_page(q->xdp_page);
+	q->xdp_page = NULL;
+	xdp_rxq_info_unreg(&q->xdp_rxq);
+	if (use_napi)
+		netif_napi_del(&q->napi);
+}
+
+/*
+ * debugfs: snull/<device>/latency, the per-queue enqueue-to-delivery
+ * histograms. Bucket b counts latencies of [2^b, 2^(b+1)) ns; writing
+ * anything to the file clears them.
+ */
+static struct dentry *snull_debugfs;
+
+static int snull_latency_show(struct seq_file *m, void *v)
+{
+	struct net_device *dev = m->private;
+	struct snull_priv *priv = netdev_priv(dev);
+	unsigned long n;
+	int i, b;
+
+	for (i = 0; i < priv->num_queues; i++) {
+		seq_printf(m, "queue %d:\n", i);
+		for (b = 0; b < SNULL_LAT_BUCKETS; b++) {
+			n = READ_ONCE(priv->queues[i].lat_hist[b]);
+			if (n)
+				seq_printf(m, "%20llu .. %20llu ns: %lu\n",
+						b ? 1ULL << b : 0, (2ULL << b) - 1, n);
+		}
+	}
+	return 0;
+}
+
+static int snull_latency_open(struct inode *inode, struct file *file)
+{
+	return single_open(file, snull_latency_show, inode->i_private);
+}
+
+static ssize_t snull_latency_write(struct file *file, const char __user *buf,
+		size_t count, loff_t *ppos)
+{
+	struct net_device *dev = ((struct seq_file *)file->private_data)->private;
+	struct snull_priv *priv = netdev_priv(dev);
+	int i, b;
+
+	for (i = 0; i < priv->num_queues; i++)
+		for (b = 0; b < SNULL_LAT_BUCKETS; b++)
+			WRITE_ONCE(priv->queues[i].lat_hist[b], 0);
+	return count;
+}
+
+static const struct file_operations snull_latency_fops = {
+	.owner = THIS_MODULE,
+	.open = snull_latency_open,
+	.read = seq_read,
+	.write = snull_latency_write,
+	.llseek = seq_lseek,
+	.release = single_release,
+};
+
+/*
+ * Allocate the per-queue state once the core knows our queue count.
+ */
+static int snull_dev_init(struct net_device *dev)
+{
+	struct snull_priv *priv = netdev_priv(dev);
+	int i, err;
+
+	/* TX queue i feeds RX queue i on the other end */
+	if (dev->real_num_rx_queues != dev->real_num_tx_queues)
+		return -EINVAL;
+	priv->num_queues = dev->real_num_tx_queues;
+	priv->rx_ring_size = SNULL_DEF_RING;
+	priv->tx_ring_size = SNULL_DEF_RING;
+	priv->rx_frames = 1; /* an interrupt per packet */
+	priv->stats = netdev_alloc_pcpu_stats(struct snull_pcpu_stats);
+	if (priv->stats == NULL)
+		return -ENOMEM;
+	priv->queues = kcalloc(priv->num_queues, sizeof(struct snull_queue), GFP_KERNEL);
+	if (priv->queues == NULL) {
+		free_percpu(priv->stats);
+		return -ENOMEM;
+	}
+
+	for (i = 0; i < priv->num_queues; i++) {
+		err = snull_queue_init(dev, &priv->queues[i], i);
+		if (err)
+			goto err;
+	}
+	if (use_napi && napi_threaded)
+		dev_set_threaded(dev, true);
+	if (priv->sw)
+		refcount_inc(&priv->sw->refs);
+	/* named at registration, a later rename isn't followed */
+	priv->debugfs = debugfs_create_dir(dev->name, snull_debugfs);
+	debugfs_create_file("latency", 0600, priv->debugfs, dev, &snull_latency_fops);
+	return 0;
+
+err:
+	while (--i >= 0)
+		snull_queue_teardown(&priv->queues[i]);
+	kfree(priv->queues);
+	priv->queues = NULL;
+	free_percpu(priv->stats);
+	return err;
+}
+
+static void snull_dev_uninit(struct net_device *dev)
+{
+	struct snull_priv *priv = netdev_priv(dev);
+	int i;
+
+	debugfs_remove_recursive(priv->debugfs);
+	priv->debugfs = NULL;
+	for (i = 0; i < priv->num_queues; i++)
+		snull_queue_teardown(&priv->queues[i]);
+	kfree(priv->queues);
+	priv->queues = NULL;
+	free_percpu(priv->stats);
+	if (priv->sw)
+		snull_switch_put(priv->sw);
+}
+
+/*
+ * Replace the pool and RX ring of every queue. Both ends of the pair
+ * must be stopped, so that every buffer is back in its pool and every
+ * RX ring is empty.
+ */
+static int snull_resize_rings(struct net_device *dev, unsigned int rx_size,
+		unsigned int tx_size)
+{
+	struct snull_priv *priv = netdev_priv(dev);
+	struct snull_ring *pools, *rx_rings;
+	struct snull_queue *q;
+	int i, err = -ENOMEM;
+
+	pools = kcalloc(priv->num_queues, sizeof(*pools), GFP_KERNEL);
+	rx_rings = kcalloc(priv->num_queues, sizeof(*rx_rings), GFP_KERNEL);
+	if (pools == NULL || rx_rings == NULL)
+		goto out;
 
-	if (priv->rx_int_enabled) {
-		priv->status |= SNULL_RX_INTR;
-		snull_interrupt(0, dest, NULL);
+	for (i = 0; i < priv->num_queues; i++) {
+		if (snull_setup_pool(&priv->queues[i], &pools[i], tx_size) ||
+				snull_ring_init(&rx_rings[i], rx_size))
+			goto unwind;
 	}
 
-	priv = netdev_priv(dev);
-	priv->tx_packetlen = len;
-	priv->tx_packetdata = buf;
-	priv->status |= SNULL_TX_INTR;
-
-	if (lockup && ((priv->stats.tx_packets + 1) % lockup) == 0) {
-		/* simulate a dropped transmit interrupt */
-		netif_stop_queue(dev);
-		printk(KERN_INFO MODULE_NAME ": Simulate lockup at %ld, txp %ld\n", 
-				jiffies, (unsigned long)priv->stats.tx_packets);
-	} else {
-		snull_interrupt(0, dev, NULL);
+	for (i = 0; i < priv->num_queues; i++) {
+		q = &priv->queues[i];
+		snull_teardown_pool(&q->pool);
+		snull_ring_free(&q->rx_ring);
+		q->pool = pools[i];
+		q->rx_ring = rx_rings[i];
+		snull_pool_reset(q);
+	}
+	priv->rx_ring_size = rx_size;
+	priv->tx_ring_size = tx_size;
+	err = 0;
+	goto out;
+
+unwind:
+	for (; i >= 0; i--) {
+		snull_teardown_pool(&pools[i]);
+		snull_ring_free(&rx_rings[i]);
 	}
+out:
+	kfree(pools);
+	kfree(rx_rings);
+	return err;
+}
 
+static void snull_get_stats64(struct net_device *dev, struct rtnl_link_stats64 *stats)
+{
+	u64 data[SNULL_STAT_NUM];
+
+	snull_stats_sum(dev, data);
+	stats->rx_packets = data[SNULL_STAT_RX_PACKETS];
+	stats->rx_bytes = data[SNULL_STAT_RX_BYTES];
+	stats->rx_dropped = data[SNULL_STAT_RX_DROPPED];
+	stats->tx_packets = data[SNULL_STAT_TX_PACKETS];
+	stats->tx_bytes = data[SNULL_STAT_TX_BYTES];
+	stats->tx_dropped = data[SNULL_STAT_TX_DROPPED];
 }
 
-void snull_setup_pool(struct net_device *dev) 
+int snull_open(struct net_device *dev)
 {
 	struct snull_priv *priv = netdev_priv(dev);
 	int i;
-	struct snull_packet *pkt;
 
-	priv->ppool = NULL;
-	for (i = 0; i < pool_size; i++) {
-		pkt = kmalloc(sizeof(struct snull_packet), GFP_KERNEL);
-		if (pkt == NULL) {
-			printk(KERN_NOTICE MODULE_NAME ": Ran out of memory allocating pkt pool\n");
-			return;
-		}
-		pkt->dev = dev;
-		pkt->next = priv->ppool;
-		priv->ppool = pkt;
+	for (i = 0; i < priv->num_queues; i++) {
+		snull_rx_ints(&priv->queues[i], 1);
+		if (use_napi)
+			napi_enable(&priv->queues[i].napi);
 	}
+	netif_tx_start_all_queues(dev);
+	return 0;
 }
 
-void snull_teardown_pool(struct net_device *dev)
+/*
+ * Hand packets nobody will poll anymore back to the peer's pool.
+ */
+static void snull_drain_rx(struct snull_queue *q)
 {
-	struct snull_priv *priv = netdev_priv(dev);
 	struct snull_packet *pkt;
 
-	while ((pkt = priv->ppool)) {
-		priv->ppool = pkt->next;
-		kfree(pkt);
+	/* the peer's xmit may still be filling the ring */
+	spin_lock_bh(&q->lock);
+	while ((pkt = snull_dequeue_buf(q)) != NULL) {
+		snull_stats_drop(q->dev, SNULL_STAT_RX_DROPPED, SNULL_STAT_RX_DROP_FLUSH);
+		snull_pkt_free_data(pkt);
+		snull_release_buffer(pkt);
 	}
+	q->coal_frames = 0;
+	spin_unlock_bh(&q->lock);
+}
+
+/*
+ * Forget about transmissions still waiting for the doorbell or for a
+ * completion that a simulated lockup swallowed.
+ */
+static void snull_drain_tx(struct snull_queue *q)
+{
+	struct netdev_queue *txq = netdev_get_tx_queue(q->dev, q->index);
+
+	__skb_queue_purge(&q->tx_pending);
+	spin_lock_bh(&q->lock);
+	__skb_queue_purge(&q->tx_done);
+	q->tx_done_pkts = 0;
+	q->tx_done_bytes = 0;
+	q->status &= ~SNULL_TX_INTR;
+	spin_unlock_bh(&q->lock);
+	netdev_tx_reset_queue(txq);
 }
 
-struct net_device_stats *snull_get_stats(struct net_device *dev)
+int snull_stop(struct net_device *dev)
 {
 	struct snull_priv *priv = netdev_priv(dev);
-	return &priv->stats;
+	struct snull_queue *q;
+	int i;
+
+	netif_tx_disable(dev);
+	for (i = 0; i < priv->num_queues; i++) {
+		q = &priv->queues[i];
+		/* no poll left to unmask the line, then mask it for good */
+		if (use_napi)
+			napi_disable(&q->napi);
+		spin_lock_bh(&q->lock);
+		snull_rx_ints(q, 0);
+		spin_unlock_bh(&q->lock);
+		/* and wait for whatever it raised before that */
+		hrtimer_cancel(&q->rx_timer);
+		irq_work_sync(&q->irq);
+		tasklet_kill(&q->bh);
+		snull_drain_rx(q);
+		snull_drain_tx(q);
+	}
+	return 0;
 }
 
-int snull_open(struct net_device *dev)
+/*
+ * Jumbo frames never go through the pool buffers (see snull_handoff),
+ * so any MTU the core let through is fine.
+ */
+static int snull_change_mtu(struct net_device *dev, int new_mtu)
 {
-	memcpy(dev->dev_addr, "\0SNUL0", ETH_ALEN);
-	if (dev == snull_devs[1])
-		dev->dev_addr[ETH_ALEN - 1]++; /* \0SNUL1 */
-	netif_start_queue(dev);
+	WRITE_ONCE(dev->mtu, new_mtu);
 	return 0;
 }
 
-int snull_stop(struct net_device *dev)
+/*
+ * The peer runs XDP on single-page frames: don't send it GSO frames.
+ */
+static netdev_features_t snull_fix_features(struct net_device *dev,
+		netdev_features_t features)
+{
+	struct net_device *peer = snull_peer(dev);
+	struct snull_priv *ppriv;
+
+	if (peer == NULL)
+		return features;
+	ppriv = netdev_priv(peer);
+	if (rcu_access_pointer(ppriv->xdp_prog))
+		features &= ~NETIF_F_GSO_SOFTWARE;
+	return features;
+}
+
+static int snull_xdp_set(struct net_device *dev, struct bpf_prog *prog,
+		struct netlink_ext_ack *extack)
 {
-	netif_stop_queue(dev);
+	struct snull_priv *priv = netdev_priv(dev);
+	struct net_device *peer = snull_peer(dev);
+	struct bpf_prog *old;
+
+	if (!use_napi) {
+		NL_SET_ERR_MSG_MOD(extack, "XDP needs the module loaded with use_napi=1");
+		return -EOPNOTSUPP;
+	}
+	if (peer == NULL) {
+		NL_SET_ERR_MSG_MOD(extack, "XDP needs a peer, not a switch");
+		return -EOPNOTSUPP;
+	}
+	/* the peer's MTU bounds what we receive */
+	if (prog && peer->mtu > SNULL_XDP_MAX_MTU) {
+		NL_SET_ERR_MSG_MOD(extack, "Peer MTU too large for XDP");
+		return -ERANGE;
+	}
+
+	old = rtnl_dereference(priv->xdp_prog);
+	rcu_assign_pointer(priv->xdp_prog, prog);
+	if (old)
+		bpf_prog_put(old);
+
+	peer->max_mtu = prog ? SNULL_XDP_MAX_MTU : SNULL_MAX_MTU;
+	netdev_update_features(peer);
 	return 0;
 }
 
-int snull_tx(struct sk_buff *skb, struct net_device *dev)
+static int snull_bpf(struct net_device *dev, struct netdev_bpf *xdp)
+{
+	switch (xdp->command) {
+	case XDP_SETUP_PROG:
+		return snull_xdp_set(dev, xdp->prog, xdp->extack);
+	default:
+		return -EINVAL;
+	}
+}
+
+static u16 snull_select_queue(struct net_device *dev, struct sk_buff *skb,
+		struct net_device *sb_dev)
+{
+	return snull_flow_queue(dev, skb_get_hash(skb));
+}
+
+netdev_tx_t snull_tx(struct sk_buff *skb, struct net_device *dev)
 {
-	int len;
-	char *data;
-	char shortpkt[ETH_ZLEN];
 	struct snull_priv *priv = netdev_priv(dev);
+	u16 qid = skb_get_queue_mapping(skb);
+	struct snull_queue *q = &priv->queues[qid];
+	struct netdev_queue *txq;
+
+	/* the pool and the peer's RX ring are on their way out */
+	if (unlikely(READ_ONCE(priv->resizing))) {
+		snull_stats_drop(dev, SNULL_STAT_TX_DROPPED, SNULL_STAT_TX_DROP_NO_BUFFER);
+		dev_kfree_skb(skb);
+		goto out;
+	}
+
+	/*
+	 * snull_hw_tx rewrites the IP header in place, so make sure we
+	 * don't scribble over a header shared with a clone (TCP, taps).
+	 */
+	if (skb_cow_head(skb, 0)) {
+		snull_stats_drop(dev, SNULL_STAT_TX_DROPPED, SNULL_STAT_TX_DROP_NOMEM);
+		dev_kfree_skb(skb);
+		goto out;
+	}
 
-	data = skb->data;
-	len = skb->len;
+	/* no room for the IP header we rewrite; before the padding hides it */
+	if (skb->len < sizeof(struct ethhdr) + sizeof(struct iphdr)) {
+		snull_stats_drop(dev, SNULL_STAT_TX_DROPPED, SNULL_STAT_TX_DROP_RUNT);
+		dev_kfree_skb(skb);
+		goto out;
+	}
 
-	if (len < ETH_ZLEN) {
-		memset(shortpkt, 0, ETH_ZLEN);
-		memcpy(shortpkt, skb->data, skb->len);
-		len = ETH_ZLEN;
-		data = shortpkt;
+	/* pad short frames in place, whichever way they travel */
+	if (skb_put_padto(skb, ETH_ZLEN)) {
+		snull_stats_drop(dev, SNULL_STAT_TX_DROPPED, SNULL_STAT_TX_DROP_NOMEM);
+		goto out;
 	}
-	dev->trans_start = jiffies; /* save the timestamp */
 
-	/* remember the skb so that we can free it at an interruption */
-	priv->skb = skb;
+	/* save the timestamp */
+	txq = netdev_get_tx_queue(dev, qid);
+	txq_trans_cond_update(txq);
+	/* SOF_TIMESTAMPING_TX_SOFTWARE */
+	skb_tx_timestamp(skb);
+	trace_snull_tx(dev, qid, skb->len);
+
+	/*
+	 * Queue it until the doorbell. BQL asks for the doorbell itself
+	 * when this is the last packet of the batch or it just stopped
+	 * the queue.
+	 */
+	__skb_queue_tail(&q->tx_pending, skb);
+	if (__netdev_tx_sent_queue(txq, skb->len, netdev_xmit_more()) ||
+			skb_queue_len(&q->tx_pending) >= tx_doorbell)
+		snull_tx_flush(q);
+
+	return NETDEV_TX_OK;
+
+out:
+	/* a dropped last packet of the batch still owes the doorbell */
+	if (!netdev_xmit_more() && !skb_queue_empty(&q->tx_pending))
+		snull_tx_flush(q);
+	return NETDEV_TX_OK;
+}
+
+/*
+ * A packet leaves the RX ring: file its enqueue-to-delivery latency
+ * in the queue's log2 histogram. Only this queue's RX handling writes
+ * it.
+ */
+static void snull_rx_account(struct snull_queue *q, struct snull_packet *pkt)
+{
+	s64 ns = ktime_to_ns(ktime_sub(ktime_get(), pkt->stamp));
 
-	snull_hw_tx(data, len, dev);
+	q->lat_hist[ns > 1 ? ilog2((u64)ns) : 0]++;
+	trace_snull_rx(q->dev, q->index, pkt->datalen, ns);
+}
 
-	return len;
+/*
+ * Hand a received skb to the stack.
+ */
+static void snull_rx_skb(struct snull_queue *q, struct sk_buff *skb)
+{
+	skb_record_rx_queue(skb, q->index);
+	if (use_napi)
+		napi_gro_receive(&q->napi, skb);
+	else
+		netif_rx(skb);
 }
 
-void snull_rx(struct net_device *dev, struct snull_packet *pkt)
+void snull_rx(struct snull_queue *q, struct snull_packet *pkt)
 {
 	struct sk_buff *skb;
-	struct snull_priv *priv = netdev_priv(dev);
+	struct net_device *dev = q->dev;
+	void *va;
+
+	snull_rx_account(q, pkt);
+	if (pkt->frame) {
+		/* an XDP frame from the peer, wrap it without copying */
+		skb = xdp_build_skb_from_frame(pkt->frame, dev);
+		if (!skb) {
+			xdp_return_frame(pkt->frame);
+			pkt->frame = NULL;
+			snull_stats_drop(dev, SNULL_STAT_RX_DROPPED, SNULL_STAT_RX_DROP_NOMEM);
+			goto out;
+		}
+		pkt->frame = NULL;
+		snull_rx_csum(dev, skb);
+		goto deliver;
+	}
+
+	if (pkt->skb) {
+		/*
+		 * Zero-copy: the sender's skb is ours now. Scrub its
+		 * TX state and set it up for this device.
+		 */
+		skb = pkt->skb;
+		pkt->skb = NULL;
+		if (__dev_forward_skb(dev, skb)) {
+			/* already freed */
+			snull_stats_drop(dev, SNULL_STAT_RX_DROPPED, SNULL_STAT_RX_DROP_FORWARD);
+			goto out;
+		}
+		snull_rx_csum(dev, skb);
+		goto deliver;
+	}
 
 	/*
 	 * The packet has been retrieved from the transmission
-	 * medium. Build an skb around it, so upper layers can handle it
+	 * medium. Build an skb around its buffer, so upper layers can
+	 * handle it; the page goes back to the sender's page_pool when
+	 * the skb is freed.
 	 */
-	skb = dev_alloc_skb(pkt->datalen + 2);
+	va = page_address(pkt->page) + pkt->offset;
+	if (use_napi)
+		skb = napi_build_skb(va, pkt->truesize);
+	else
+		skb = build_skb(va, pkt->truesize);
 	if (!skb) {
 		if (printk_ratelimit())
 			printk(KERN_NOTICE "snull rx: low on mem - packet dropped\n");
-		priv->stats.rx_dropped++;
+		snull_pkt_free_data(pkt);
+		snull_stats_drop(dev, SNULL_STAT_RX_DROPPED, SNULL_STAT_RX_DROP_NOMEM);
 		goto out;
 	}
-	skb_reserve(skb, 2); /* align IP on 16B boundary */  
-	memcpy(skb_put(skb, pkt->datalen), pkt->data, pkt->datalen);
+	pkt->page = NULL;
+	skb_reserve(skb, SNULL_HEADROOM); /* NET_IP_ALIGN keeps IP aligned */
+	__skb_put(skb, pkt->datalen);
+	skb_mark_for_recycle(skb);
 
 	/* Write metadata, and then pass to the receive level */
 	skb->dev = dev;
 	skb->protocol = eth_type_trans(skb, dev);
-	skb->ip_summed = CHECKSUM_UNNECESSARY; /* don't check it */
-	priv->stats.rx_packets++;
-	priv->stats.rx_bytes += pkt->datalen;
-	netif_rx(skb);
+	snull_rx_csum(dev, skb);
+  deliver:
+	snull_stats_packet(dev, SNULL_STAT_RX_PACKETS, SNULL_STAT_RX_BYTES, pkt->datalen);
+	snull_rx_skb(q, skb);
   out:
 	return;
 }
@@ -319,57 +1995,395 @@ void snull_rx(struct net_device *dev, struct snull_packet *pkt)
 static void snull_regular_interrupt(int irq, void *dev_id, struct pt_regs *regs)
 {
 	int statusword;
-	struct snull_priv *priv;
+	struct snull_queue *q;
 	struct snull_packet *pkt = NULL;
 	/*
 	 * As usual, check the "device" pointer to be sure it is
 	 * really interrupting.
-	 * Then assign "struct device *dev"
+	 * Every queue has its own vector, so dev_id is the queue itself;
+	 * we run in its tasklet, see snull_irq.
 	 */
-	struct net_device *dev = (struct net_device *)dev_id;
+	q = (struct snull_queue *)dev_id;
 	/* ... and check with hw if it's really ours */
 
 	/* paranoid */
-	if (!dev)
+	if (!q)
 		return;
 
-	/* Lock the device */
-	priv = netdev_priv(dev);
-	spin_lock(&priv->lock);
+	/* Lock the queue */
+	spin_lock(&q->lock);
 
 	/* retrieve statusword: real netdevices use I/O instructions */
-	statusword = priv->status;
-	priv->status = 0;
+	statusword = q->status;
+	q->status = 0;
 	if (statusword & SNULL_RX_INTR) {
-		/* send it to snull_rx for handling */
-		pkt = priv->rx_queue;
-		if (pkt) {
-			priv->rx_queue = pkt->next;
-			snull_rx(dev, pkt);
-		}
+		/*
+		 * send everything that has arrived to snull_rx for handling;
+		 * with moderation one interrupt covers several packets.
+		 * The pool ring is lock-free, buffers go back right away.
+		 */
+		do {
+			while ((pkt = snull_rx_next(q)) != NULL) {
+				snull_rx(q, pkt);
+				snull_release_buffer(pkt);
+			}
+		} while (snull_rx_rearm(q));
 	}
+
+	/* Unlock the queue */
+	spin_unlock(&q->lock);
+
 	if (statusword & SNULL_TX_INTR) {
-		/* a transmission is over: free the skb */
-		priv->stats.tx_packets++;
-		priv->stats.tx_bytes += priv->tx_packetlen;
-		dev_kfree_skb(priv->skb);
+		/* a batch of transmissions is over */
+		snull_tx_complete(q, 0);
 	}
-
-	/* Unlock the device and we are done */
-	spin_unlock(&priv->lock);
-	if (pkt) snull_release_buffer(pkt); /* Do this outside the lock! */
 	return;
 }
 
+static struct page *snull_xdp_get_page(struct snull_queue *q)
+{
+	struct page *page = q->xdp_page;
+
+	if (page) {
+		q->xdp_page = NULL;
+		return page;
+	}
+	return dev_alloc_page();
+}
+
+static void snull_xdp_put_page(struct snull_queue *q, struct page *page)
+{
+	if (q->xdp_page == NULL)
+		q->xdp_page = page;
+	else
+		put_page(page);
+}
+
+/*
+ * Run the XDP program on one received packet. Frames from the peer's
+ * ndo_xdp_xmit are run in place; copied buffers and handed-over skbs
+ * are first copied into a page of our own, so that XDP_TX and
+ * XDP_REDIRECT can pass them on as ordinary xdp_frames.
+ * Returns true when the packet was redirected.
+ */
+static bool snull_xdp_rx(struct snull_queue *q, struct bpf_prog *prog,
+		struct snull_packet *pkt)
+{
+	struct net_device *dev = q->dev;
+	struct xdp_frame *frame = pkt->frame;
+	struct xdp_rxq_info frame_rxq;
+	struct page *page = NULL;
+	struct xdp_buff xdp;
+	struct sk_buff *skb;
+	u32 act;
+
+	snull_rx_account(q, pkt);
+	snull_stats_packet(dev, SNULL_STAT_RX_PACKETS, SNULL_STAT_RX_BYTES, pkt->datalen);
+
+	if (frame) {
+		pkt->frame = NULL;
+		xdp_convert_frame_to_buff(frame, &xdp);
+		/* the frame keeps the sender's memory model, q->xdp_rxq keeps ours */
+		frame_rxq = (struct xdp_rxq_info) {
+			.dev = dev,
+			.queue_index = q->xdp_rxq.queue_index,
+			.mem = frame->mem,
+		};
+		xdp.rxq = &frame_rxq;
+	} else {
+		if (pkt->datalen > SNULL_XDP_MAX_LEN)
+			goto drop_pkt;
+		page = snull_xdp_get_page(q);
+		if (page == NULL)
+			goto drop_pkt;
+		if (pkt->skb)
+			snull_copy_frame(pkt->skb, page_address(page) + XDP_PACKET_HEADROOM);
+		else
+			memcpy(page_address(page) + XDP_PACKET_HEADROOM,
+					snull_pkt_data(pkt), pkt->datalen);
+		snull_pkt_free_data(pkt);
+		xdp_init_buff(&xdp, PAGE_SIZE, &q->xdp_rxq);
+		xdp_prepare_buff(&xdp, page_address(page), XDP_PACKET_HEADROOM,
+				pkt->datalen, true);
+	}
+
+	act = bpf_prog_run_xdp(prog, &xdp);
+	switch (act) {
+	case XDP_PASS:
+		frame = xdp_convert_buff_to_frame(&xdp);
+		if (frame == NULL)
+			goto drop;
+		skb = xdp_build_skb_from_frame(frame, dev);
+		if (skb == NULL) {
+			xdp_return_frame(frame);
+			snull_stats_drop(dev, SNULL_STAT_RX_DROPPED, SNULL_STAT_RX_DROP_NOMEM);
+			return false;
+		}
+		snull_rx_csum(dev, skb);
+		snull_stats_add(dev, SNULL_STAT_XDP_PASS, 1);
+		snull_rx_skb(q, skb);
+		return false;
+	case XDP_TX:
+		/* bounce it back out of this device, i.e. to the peer */
+		frame = xdp_convert_buff_to_frame(&xdp);
+		if (frame == NULL)
+			goto drop;
+		if (snull_xdp_xmit(dev, 1, &frame, 0) != 1) {
+			xdp_return_frame(frame);
+			snull_stats_drop(dev, SNULL_STAT_RX_DROPPED, SNULL_STAT_RX_DROP_XDP);
+			return false;
+		}
+		snull_stats_add(dev, SNULL_STAT_XDP_TX, 1);
+		return false;
+	case XDP_REDIRECT:
+		if (xdp_do_redirect(dev, &xdp, prog))
+			goto drop;
+		snull_stats_add(dev, SNULL_STAT_XDP_REDIRECT, 1);
+		return true;
+	default:
+		bpf_warn_invalid_xdp_action(dev, prog, act);
+		fallthrough;
+	case XDP_ABORTED:
+		trace_xdp_exception(dev, prog, act);
+		fallthrough;
+	case XDP_DROP:
+		snull_stats_add(dev, SNULL_STAT_XDP_DROP, 1);
+		if (page)
+			snull_xdp_put_page(q, page);
+		else
+			xdp_return_buff(&xdp);
+		return false;
+	}
+
+drop:
+	snull_stats_drop(dev, SNULL_STAT_RX_DROPPED, SNULL_STAT_RX_DROP_XDP);
+	if (page)
+		snull_xdp_put_page(q, page);
+	else
+		xdp_return_buff(&xdp);
+	return false;
+
+drop_pkt:
+	snull_stats_drop(dev, SNULL_STAT_RX_DROPPED, SNULL_STAT_RX_DROP_XDP);
+	snull_pkt_free_data(pkt);
+	return false;
+}
+
+/*
+ * The poll implementation.
+ */
+static int snull_poll(struct napi_struct *napi, int budget)
+{
+	int npackets = 0;
+	bool redirected = false, due;
+	struct snull_packet *pkt;
+	struct snull_queue *q = container_of(napi, struct snull_queue, napi);
+	struct snull_priv *priv = netdev_priv(q->dev);
+	struct bpf_prog *prog;
+
+	/* TX completions first, they don't count against the budget */
+	snull_tx_complete(q, budget);
+
+	rcu_read_lock();
+	prog = rcu_dereference(priv->xdp_prog);
+	while (npackets < budget && (pkt = snull_rx_next(q)) != NULL) {
+		if (prog)
+			redirected |= snull_xdp_rx(q, prog, pkt);
+		else
+			snull_rx(q, pkt);
+		snull_release_buffer(pkt);
+		npackets++;
+	}
+	if (redirected)
+		xdp_do_flush();
+	rcu_read_unlock();
+
+	if (npackets < budget && napi_complete_done(napi, npackets)) {
+		/* all done, turn interrupts back on */
+		spin_lock(&q->lock);
+		q->status &= ~SNULL_RX_INTR;
+		snull_rx_ints(q, 1);
+		due = snull_rx_rearm(q);
+		spin_unlock(&q->lock);
+		/* catch a packet that arrived while interrupts were still off */
+		if (due && napi_schedule_prep(napi)) {
+			snull_rx_ints(q, 0);
+			__napi_schedule(napi);
+		}
+	}
+	return npackets;
+}
+
+static int snull_get_iflink(const struct net_device *dev)
+{
+	struct snull_priv *priv = netdev_priv(dev);
+	struct net_device *peer;
+	int iflink;
+
+	rcu_read_lock();
+	peer = rcu_dereference(priv->peer);
+	iflink = peer ? peer->ifindex : 0;
+	rcu_read_unlock();
+	return iflink;
+}
+
 static const struct net_device_ops snull_ops = {
+	.ndo_init = snull_dev_init,
+	.ndo_uninit = snull_dev_uninit,
 	.ndo_open = snull_open,
 	.ndo_stop = snull_stop,
 	.ndo_start_xmit = snull_tx,
-	.ndo_get_stats = snull_get_stats,
+	.ndo_select_queue = snull_select_queue,
+	.ndo_change_mtu = snull_change_mtu,
+	.ndo_fix_features = snull_fix_features,
+	.ndo_bpf = snull_bpf,
+	.ndo_xdp_xmit = snull_xdp_xmit,
+	.ndo_get_stats64 = snull_get_stats64,
+	.ndo_get_iflink = snull_get_iflink,
 };
 
+static void snull_get_ringparam(struct net_device *dev,
+		struct ethtool_ringparam *ring,
+		struct kernel_ethtool_ringparam *kernel_ring,
+		struct netlink_ext_ack *extack)
+{
+	struct snull_priv *priv = netdev_priv(dev);
+
+	ring->rx_max_pending = SNULL_MAX_RING;
+	ring->tx_max_pending = SNULL_MAX_RING;
+	ring->rx_pending = priv->rx_ring_size;
+	ring->tx_pending = priv->tx_ring_size;
+}
+
+static int snull_set_ringparam(struct net_device *dev,
+		struct ethtool_ringparam *ring,
+		struct kernel_ethtool_ringparam *kernel_ring,
+		struct netlink_ext_ack *extack)
+{
+	struct snull_priv *priv = netdev_priv(dev);
+	struct net_device *ends[2] = { dev, snull_peer(dev) };
+	struct net_device **devs = ends;
+	DECLARE_BITMAP(running, SNULL_MAX_PORTS);
+	struct snull_priv *p;
+	int i, n = ends[1] ? 2 : 1;
+	int err, ret;
+
+	if (ring->rx_mini_pending || ring->rx_jumbo_pending)
+		return -EINVAL;
+
+	/*
+	 * Our buffers may sit in the peer's RX ring (in every other
+	 * switch port's) and the other way round, so quiesce all of
+	 * them before swapping the rings. The devices stay up as far as
+	 * the stack knows: turn away new transmissions and redirects
+	 * first, and wait for those already past the check.
+	 */
+	if (priv->sw) {
+		devs = priv->sw->ports;
+		n = priv->sw->nr_ports;
+	}
+	for (i = 0; i < n; i++) {
+		p = netdev_priv(devs[i]);
+		WRITE_ONCE(p->resizing, true);
+	}
+	synchronize_net();
+	for (i = 0; i < n; i++) {
+		__assign_bit(i, running, netif_running(devs[i]));
+		if (test_bit(i, running))
+			snull_stop(devs[i]);
+	}
+
+	err = snull_resize_rings(dev, snull_ring_size(ring->rx_pending),
+			snull_ring_size(ring->tx_pending));
+
+	for (i = n - 1; i >= 0; i--) {
+		p = netdev_priv(devs[i]);
+		WRITE_ONCE(p->resizing, false);
+		if (test_bit(i, running)) {
+			ret = snull_open(devs[i]);
+			if (ret && !err)
+				err = ret;
+		}
+	}
+	return err;
+}
+
+static int snull_get_coalesce(struct net_device *dev,
+		struct ethtool_coalesce *ec,
+		struct kernel_ethtool_coalesce *kernel_coal,
+		struct netlink_ext_ack *extack)
+{
+	struct snull_priv *priv = netdev_priv(dev);
+
+	ec->rx_coalesce_usecs = priv->rx_usecs;
+	ec->rx_max_coalesced_frames = priv->rx_frames;
+	return 0;
+}
+
+/*
+ * New values apply from the next packet on, an interrupt already
+ * scheduled still fires at its old time.
+ */
+static int snull_set_coalesce(struct net_device *dev,
+		struct ethtool_coalesce *ec,
+		struct kernel_ethtool_coalesce *kernel_coal,
+		struct netlink_ext_ack *extack)
+{
+	struct snull_priv *priv = netdev_priv(dev);
+
+	if (ec->rx_coalesce_usecs > USEC_PER_SEC ||
+			ec->rx_max_coalesced_frames > SNULL_MAX_RING)
+		return -EINVAL;
+	WRITE_ONCE(priv->rx_usecs, ec->rx_coalesce_usecs);
+	WRITE_ONCE(priv->rx_frames, ec->rx_max_coalesced_frames);
+	return 0;
+}
+
+static int snull_get_link_ksettings(struct net_device *dev,
+		struct ethtool_link_ksettings *cmd)
+{
+	cmd->base.speed = bandwidth ? bandwidth : SPEED_UNKNOWN;
+	cmd->base.duplex = DUPLEX_FULL;
+	cmd->base.port = PORT_OTHER;
+	cmd->base.autoneg = AUTONEG_DISABLE;
+	return 0;
+}
+
+static int snull_get_sset_count(struct net_device *dev, int sset)
+{
+	switch (sset) {
+	case ETH_SS_STATS:
+		return SNULL_STAT_NUM;
+	default:
+		return -EOPNOTSUPP;
+	}
+}
+
+static void snull_get_strings(struct net_device *dev, u32 stringset, u8 *data)
+{
+	if (stringset == ETH_SS_STATS)
+		memcpy(data, snull_stat_strings, sizeof(snull_stat_strings));
+}
+
+static void snull_get_ethtool_stats(struct net_device *dev,
+		struct ethtool_stats *stats, u64 *data)
+{
+	snull_stats_sum(dev, data);
+}
+
 static const struct ethtool_ops snull_ethtool_ops = {
+	.supported_coalesce_params = ETHTOOL_COALESCE_RX_USECS |
+		ETHTOOL_COALESCE_RX_MAX_FRAMES,
 	.get_link = always_on,
+	.get_ts_info = ethtool_op_get_ts_info,
+	.get_link_ksettings = snull_get_link_ksettings,
+	.get_sset_count = snull_get_sset_count,
+	.get_strings = snull_get_strings,
+	.get_ethtool_stats = snull_get_ethtool_stats,
+	.get_ringparam = snull_get_ringparam,
+	.set_ringparam = snull_set_ringparam,
+	.get_coalesce = snull_get_coalesce,
+	.set_coalesce = snull_set_coalesce,
 };
 
 void snull_setup(struct net_device *dev)
@@ -380,34 +2394,297 @@ void snull_setup(struct net_device *dev)
 	ether_setup(dev);
 
 	dev->netdev_ops = &snull_ops;
+	dev->rtnl_link_ops = &snull_link_ops;
+	dev->needs_free_netdev = true;
 
 	/* test */
 	dev->ethtool_ops = &snull_ethtool_ops;
 
 	/* flags */
 	dev->flags |= IFF_NOARP;
-	dev->features |= NETIF_F_HW_CSUM;
+	dev->features |= SNULL_FEATURES;
+	dev->hw_features |= SNULL_FEATURES;
+	dev->min_mtu = ETH_MIN_MTU;
+	dev->max_mtu = SNULL_MAX_MTU;
 
+	/* native XDP runs in the NAPI poll, ndo_xdp_xmit works either way */
+	dev->xdp_features = NETDEV_XDP_ACT_NDO_XMIT;
+	if (use_napi)
+		dev->xdp_features |= NETDEV_XDP_ACT_BASIC | NETDEV_XDP_ACT_REDIRECT;
+
+	/* queues and pools are allocated in snull_dev_init() */
 	priv = netdev_priv(dev);
 	memset(priv, 0, sizeof(struct snull_priv));
-	spin_lock_init(&priv->lock);
-	snull_rx_ints(dev, 1);
-	snull_setup_pool(dev);
 
 	return;
 }
 
-void snull_exit(void)
+/*
+ * rtnetlink: "ip link add [NAME] type snull [peer [name NAME] ...]".
+ * The peer attribute carries an ifinfomsg and its attributes, laid out
+ * like veth's.
+ */
+enum {
+	IFLA_SNULL_UNSPEC,
+	IFLA_SNULL_PEER,
+	__IFLA_SNULL_MAX
+};
+#define IFLA_SNULL_MAX (__IFLA_SNULL_MAX - 1)
+
+static const struct nla_policy snull_policy[IFLA_SNULL_MAX + 1] = {
+	[IFLA_SNULL_PEER] = { .len = sizeof(struct ifinfomsg) },
+};
+
+static void snull_link_pair(struct net_device *a, struct net_device *b)
+{
+	struct snull_priv *pa = netdev_priv(a);
+	struct snull_priv *pb = netdev_priv(b);
+
+	rcu_assign_pointer(pa->peer, b);
+	rcu_assign_pointer(pb->peer, a);
+}
+
+static int snull_validate(struct nlattr *tb[], struct nlattr *data[],
+		struct netlink_ext_ack *extack)
+{
+	if (tb[IFLA_ADDRESS]) {
+		if (nla_len(tb[IFLA_ADDRESS]) != ETH_ALEN)
+			return -EINVAL;
+		if (!is_valid_ether_addr(nla_data(tb[IFLA_ADDRESS])))
+			return -EADDRNOTAVAIL;
+	}
+	return 0;
+}
+
+static int snull_newlink(struct net *src_net, struct net_device *dev,
+		struct nlattr *tb[], struct nlattr *data[],
+		struct netlink_ext_ack *extack)
+{
+	struct nlattr *peer_tb[IFLA_MAX + 1], **tbp = tb;
+	struct ifinfomsg *ifmp = NULL;
+	unsigned char name_assign_type;
+	char ifname[IFNAMSIZ];
+	struct net_device *peer;
+	struct net *net;
+	int err;
+
+	if (data && data[IFLA_SNULL_PEER]) {
+		ifmp = nla_data(data[IFLA_SNULL_PEER]);
+		err = rtnl_nla_parse_ifinfomsg(peer_tb, data[IFLA_SNULL_PEER], extack);
+		if (err < 0)
+			return err;
+		err = snull_validate(peer_tb, NULL, extack);
+		if (err < 0)
+			return err;
+		tbp = peer_tb;
+	}
+
+	if (ifmp && tbp[IFLA_IFNAME]) {
+		nla_strscpy(ifname, tbp[IFLA_IFNAME], IFNAMSIZ);
+		name_assign_type = NET_NAME_USER;
+	} else {
+		snprintf(ifname, IFNAMSIZ, "sn%%d");
+		name_assign_type = NET_NAME_ENUM;
+	}
+
+	net = rtnl_link_get_net(src_net, tbp);
+	if (IS_ERR(net))
+		return PTR_ERR(net);
+	peer = rtnl_create_link(net, ifname, name_assign_type, &snull_link_ops,
+			tbp, extack);
+	if (IS_ERR(peer)) {
+		put_net(net);
+		return PTR_ERR(peer);
+	}
+	/* TX queue i of one end feeds RX queue i of the other */
+	if (peer->real_num_tx_queues != dev->real_num_tx_queues) {
+		NL_SET_ERR_MSG_MOD(extack, "Both ends need the same number of queues");
+		put_net(net);
+		free_netdev(peer);
+		return -EINVAL;
+	}
+	if (ifmp && dev->ifindex)
+		peer->ifindex = ifmp->ifi_index;
+
+	err = register_netdevice(peer);
+	put_net(net);
+	if (err < 0) {
+		free_netdev(peer);
+		return err;
+	}
+	err = rtnl_configure_link(peer, ifmp, 0, NULL);
+	if (err < 0)
+		goto err_peer;
+
+	if (tb[IFLA_IFNAME])
+		nla_strscpy(dev->name, tb[IFLA_IFNAME], IFNAMSIZ);
+	else
+		snprintf(dev->name, IFNAMSIZ, "sn%%d");
+	err = register_netdevice(dev);
+	if (err < 0)
+		goto err_peer;
+
+	snull_link_pair(dev, peer);
+	return 0;
+
+err_peer:
+	unregister_netdevice(peer);
+	return err;
+}
+
+/*
+ * A pair goes away as a whole, so does a switch: the other end (every
+ * other port) holds our buffers and we hold theirs.
+ */
+static void snull_dellink(struct net_device *dev, struct list_head *head)
 {
+	struct snull_priv *priv = netdev_priv(dev);
+	struct net_device *peer = rtnl_dereference(priv->peer);
 	int i;
-	printk(KERN_INFO MODULE_NAME ": start unloading...\n");
+
+	if (priv->sw) {
+		for (i = 0; i < priv->sw->nr_ports; i++)
+			unregister_netdevice_queue(priv->sw->ports[i], head);
+		return;
+	}
+
+	unregister_netdevice_queue(dev, head);
+	if (peer) {
+		RCU_INIT_POINTER(priv->peer, NULL);
+		priv = netdev_priv(peer);
+		RCU_INIT_POINTER(priv->peer, NULL);
+		unregister_netdevice_queue(peer, head);
+	}
+}
+
+static unsigned int snull_get_num_queues(void)
+{
+	return snull_num_queues();
+}
+
+static struct rtnl_link_ops snull_link_ops = {
+	.kind = "snull",
+	.priv_size = sizeof(struct snull_priv),
+	.setup = snull_setup,
+	.validate = snull_validate,
+	.newlink = snull_newlink,
+	.dellink = snull_dellink,
+	.policy = snull_policy,
+	.maxtype = IFLA_SNULL_MAX,
+	.get_num_tx_queues = snull_get_num_queues,
+	.get_num_rx_queues = snull_get_num_queues,
+};
+
+static struct net_device *snull_alloc(const char *name)
+{
+	int nq = snull_num_queues();
+
+	return alloc_netdev_mqs(sizeof(struct snull_priv), name, NET_NAME_ENUM,
+			snull_setup, nq, nq);
+}
+
+/*
+ * Load-time pairs. The first one keeps the classic addresses,
+ * \0SNUL0 and \0SNUL1. Called with the rtnl lock held.
+ */
+static int snull_create_pair(int n)
+{
+	struct net_device *dev[2];
+	u8 addr[ETH_ALEN];
+	int i, err;
+
+	dev[0] = snull_alloc("sn%d");
+	dev[1] = snull_alloc("sn%d");
+	if (dev[0] == NULL || dev[1] == NULL) {
+		printk(KERN_ALERT MODULE_NAME ": failed to allocate network device.\n");
+		err = -ENOMEM;
+		goto out_free;
+	}
+	if (n == 0) {
+		memcpy(addr, "\0SNUL0", ETH_ALEN);
+		for (i = 0; i < 2; i++, addr[ETH_ALEN - 1]++)
+			eth_hw_addr_set(dev[i], addr);
+	}
+
+	err = register_netdevice(dev[0]);
+	if (err)
+		goto out_free;
+	err = register_netdevice(dev[1]);
+	if (err) {
+		unregister_netdevice(dev[0]);
+		free_netdev(dev[1]);
+		goto out;
+	}
+	snull_link_pair(dev[0], dev[1]);
+	return 0;
+
+out_free:
 	for (i = 0; i < 2; i++) {
-		if (snull_devs[i]) {
-			unregister_netdev(snull_devs[i]);
-			snull_teardown_pool(snull_devs[i]);
-			free_netdev(snull_devs[i]);
+		if (dev[i])
+			free_netdev(dev[i]);
+	}
+out:
+	printk(KERN_INFO MODULE_NAME ": error %i creating pair %d\n", err, n);
+	return err;
+}
+
+/*
+ * Switch mode: nports ports sharing one forwarding database. The
+ * switch learns, so ARP works as on a real LAN. Called with the rtnl
+ * lock held.
+ */
+static int snull_create_switch(int nports)
+{
+	struct snull_switch *sw;
+	struct snull_priv *priv;
+	struct net_device *dev;
+	int i, err = 0;
+
+	nports = clamp(nports, 2, SNULL_MAX_PORTS);
+	sw = kzalloc(struct_size(sw, ports, nports), GFP_KERNEL);
+	if (sw == NULL)
+		return -ENOMEM;
+	refcount_set(&sw->refs, 1);
+	spin_lock_init(&sw->lock);
+	hash_init(sw->fdb);
+
+	for (i = 0; i < nports; i++) {
+		dev = snull_alloc("sw%d");
+		if (dev == NULL) {
+			err = -ENOMEM;
+			break;
 		}
+		priv = netdev_priv(dev);
+		priv->sw = sw;
+		dev->flags &= ~IFF_NOARP;
+		dev->xdp_features = 0;
+		err = register_netdevice(dev);
+		if (err) {
+			free_netdev(dev);
+			break;
+		}
+		sw->ports[sw->nr_ports++] = dev;
+	}
+	if (err) {
+		printk(KERN_INFO MODULE_NAME ": error %i creating switch port %d\n", err, i);
+		for (i = 0; i < sw->nr_ports; i++)
+			unregister_netdevice(sw->ports[i]);
 	}
+	snull_switch_put(sw);
+	return err;
+}
+
+void snull_exit(void)
+{
+	printk(KERN_INFO MODULE_NAME ": start unloading...\n");
+
+	/*
+	 * Deletes every snull device in one batch: all of them are
+	 * stopped (and their RX queues drained back into the senders'
+	 * pools) before any frees its pool in ndo_uninit.
+	 */
+	rtnl_link_unregister(&snull_link_ops);
+	debugfs_remove_recursive(snull_debugfs);
 
 	printk(KERN_INFO MODULE_NAME ": unloading done.\n");
 	return;
@@ -416,37 +2693,29 @@ void snull_exit(void)
 int snull_init(void)
 {
 	int i;
-	int result;
-	int ret = -ENOMEM;
+	int ret;
 	printk(KERN_INFO MODULE_NAME ": start loading...\n");
 
-	snull_interrupt = snull_regular_interrupt;
+	snull_debugfs = debugfs_create_dir("snull", NULL);
 
-	/* allocate the devices */
-	snull_devs[0] = alloc_netdev(sizeof(struct snull_priv), "sn%d", NET_NAME_UNKNOWN, snull_setup);
-	snull_devs[1] = alloc_netdev(sizeof(struct snull_priv), "sn%d", NET_NAME_UNKNOWN, snull_setup);
-
-	if (snull_devs[0] == NULL || snull_devs[1] == NULL) {
-		printk(KERN_ALERT MODULE_NAME ": failed to allocate network device.\n");
-		goto out;
+	ret = rtnl_link_register(&snull_link_ops);
+	if (ret) {
+		debugfs_remove_recursive(snull_debugfs);
+		return ret;
 	}
 
-	ret = -ENODEV;
-
-	for (i = 0; i < 2; i++) {
-		if ((result = register_netdev(snull_devs[i]))) {
-			printk(KERN_INFO MODULE_NAME ": error %i registering device \"%s\"\n",
-					result, snull_devs[i]->name);
-		} else {
-			/* device registering OK */
-			ret = 0;
-		}
-
+	rtnl_lock();
+	if (switch_ports > 0) {
+		ret = snull_create_switch(switch_ports);
+	} else {
+		for (i = 0; i < pairs && !ret; i++)
+			ret = snull_create_pair(i);
 	}
+	rtnl_unlock();
 
-out: if (ret)
-		 snull_exit();
-	 return ret;
+	if (ret)
+		snull_exit();
+	return ret;
 }
 
 
@@ -0,0 +1,102 @@
+/*
+ * Tracepoints of the snull datapath: perf/ftrace "snull:*".
+ * They cost a patched-out branch while disabled.
+ */
+#undef TRACE_SYSTEM
+#define TRACE_SYSTEM snull
+
+#if !defined(_SNULL_TRACE_H) || defined(TRACE_HEADER_MULTI_READ)
+#define _SNULL_TRACE_H
+
+#include <linux/tracepoint.h>
+#include <linux/netdevice.h>
+
+/* the stack hands us a packet */
+TRACE_EVENT(snull_tx,
+	TP_PROTO(const struct net_device *dev, int queue, unsigned int len),
+	TP_ARGS(dev, queue, len),
+	TP_STRUCT__entry(
+		__string(name, dev->name)
+		__field(int, queue)
+		__field(unsigned int, len)
+	),
+	TP_fast_assign(
+		__assign_str(name, dev->name);
+		__entry->queue = queue;
+		__entry->len = len;
+	),
+	TP_printk("dev=%s queue=%d len=%u",
+		__get_str(name), __entry->queue, __entry->len)
+);
+
+/* a packet lands in the RX ring of dev, delay_ns before it arrives */
+TRACE_EVENT(snull_enqueue,
+	TP_PROTO(const struct net_device *dev, int queue, unsigned int len,
+		s64 delay_ns),
+	TP_ARGS(dev, queue, len, delay_ns),
+	TP_STRUCT__entry(
+		__string(name, dev->name)
+		__field(int, queue)
+		__field(unsigned int, len)
+		__field(s64, delay_ns)
+	),
+	TP_fast_assign(
+		__assign_str(name, dev->name);
+		__entry->queue = queue;
+		__entry->len = len;
+		__entry->delay_ns = delay_ns;
+	),
+	TP_printk("dev=%s queue=%d len=%u delay=%lldns",
+		__get_str(name), __entry->queue, __entry->len, __entry->delay_ns)
+);
+
+/* a packet leaves the RX ring for the stack or XDP */
+TRACE_EVENT(snull_rx,
+	TP_PROTO(const struct net_device *dev, int queue, unsigned int len,
+		s64 latency_ns),
+	TP_ARGS(dev, queue, len, latency_ns),
+	TP_STRUCT__entry(
+		__string(name, dev->name)
+		__field(int, queue)
+		__field(unsigned int, len)
+		__field(s64, latency_ns)
+	),
+	TP_fast_assign(
+		__assign_str(name, dev->name);
+		__entry->queue = queue;
+		__entry->len = len;
+		__entry->latency_ns = latency_ns;
+	),
+	TP_printk("dev=%s queue=%d len=%u latency=%lldns",
+		__get_str(name), __entry->queue, __entry->len, __entry->latency_ns)
+);
+
+/* a batch of transmissions is completed */
+TRACE_EVENT(snull_tx_complete,
+	TP_PROTO(const struct net_device *dev, int queue, unsigned int pkts,
+		unsigned int bytes),
+	TP_ARGS(dev, queue, pkts, bytes),
+	TP_STRUCT__entry(
+		__string(name, dev->name)
+		__field(int, queue)
+		__field(unsigned int, pkts)
+		__field(unsigned int, bytes)
+	),
+	TP_fast_assign(
+		__assign_str(name, dev->name);
+		__entry->queue = queue;
+		__entry->pkts = pkts;
+		__entry->bytes = bytes;
+	),
+	TP_printk("dev=%s queue=%d pkts=%u bytes=%u",
+		__get_str(name), __entry->queue, __entry->pkts, __entry->bytes)
+);
+
+#endif /* _SNULL_TRACE_H */
+
+/* this header lives next to snull.c, not in include/trace/events */
+#undef TRACE_INCLUDE_PATH
+#define TRACE_INCLUDE_PATH .
+#undef TRACE_INCLUDE_FILE
+#define TRACE_INCLUDE_FILE snull_trace
+#include <trace/define_trace.h>